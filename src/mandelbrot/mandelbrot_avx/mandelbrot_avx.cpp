@@ -15,100 +15,23 @@
 // ----------------------------------------------------------------------------------------------
 
 // g++ -g --std=c++14 -pipe -Wall -O3 -ffast-math -fno-finite-math-only -march=native -mavx -fopenmp mandelbrot_avx.cpp
+// Portable build, the AVX kernel is selected at runtime:
+// g++ -g --std=c++14 -pipe -Wall -O3 -ffast-math -fno-finite-math-only -fopenmp mandelbrot_avx.cpp
 
 #include "stdafx.h"
 
-#include <cassert>
-#include <cstddef>
-#include <cstdio>
-#include <chrono>
-#include <memory>
-#include <tuple>
-
-#include <emmintrin.h>
-#include <immintrin.h>
-
-#ifdef _MSVC_LANG
-# define MANDEL_INLINE __forceinline
-#else
-# define MANDEL_INLINE inline
+// mandelbrot_avx and mandelbrot_avx_full must round alike, a word starts
+//  with the early-out one and a pixel's bits can't depend on its neighbours.
+//  Under -ffast-math GCC reorders the steps of each differently.
+#if defined (__GNUC__) && !defined (__clang__)
+# pragma GCC optimize ("no-associative-math", "fp-contract=off")
 #endif
 
+#include "../mandelbrot_engine/mandelbrot_engine.hpp"
+
 namespace
 {
-  constexpr auto    min_x    = -1.5F              ;
-  constexpr auto    min_y    = -1.0F              ;
-  constexpr auto    max_x    =  0.5F              ;
-  constexpr auto    max_y    =  1.0F              ;
-
-  template<typename T>
-  auto time_it (T a)
-  {
-    auto before = std::chrono::high_resolution_clock::now ();
-    auto result = a ();
-    auto after  = std::chrono::high_resolution_clock::now ();
-    auto diff   = std::chrono::duration_cast<std::chrono::milliseconds> (after - before).count ();
-    return std::make_tuple (diff, std::move (result));
-  }
-
-  struct bitmap
-  {
-    using uptr = std::unique_ptr<bitmap>;
-
-    std::size_t const x ;
-    std::size_t const y ;
-    std::size_t const w ;
-    std::size_t const sz;
-
-    bitmap (std::size_t x, std::size_t y) noexcept
-      : x   (x)
-      , y   (y)
-      , w   ((x + 7) / 8)
-      , sz  (w*y)
-    {
-      b = static_cast<std::uint8_t*> (malloc (sz));
-    }
-
-    ~bitmap () noexcept
-    {
-      free (b);
-      b = nullptr;
-    }
-
-    bitmap (bitmap && bm) noexcept
-      : x   (bm.x)
-      , y   (bm.y)
-      , w   (bm.w)
-      , b   (bm.b)
-      , sz  (bm.sz)
-    {
-      bm.b = nullptr;
-    }
-
-    bitmap (bitmap const &)             = delete;
-    bitmap& operator= (bitmap const &)  = delete;
-    bitmap& operator= (bitmap &&)       = delete;
-
-    std::uint8_t * bits () noexcept
-    {
-      assert (b);
-      return b;
-    }
-
-    std::uint8_t const * bits () const noexcept
-    {
-      assert (b);
-      return b;
-    }
-
-  private:
-    std::uint8_t * b;
-  };
-
-  bitmap::uptr create_bitmap (std::size_t x, std::size_t y)
-  {
-    return std::make_unique<bitmap> (x, y);
-  }
+  using mandel::view;
 
 #define MANDEL_INDEPENDENT(i)                                         \
         xy[i] = _mm256_mul_ps (x[i], y[i]);                           \
@@ -148,17 +71,17 @@ namespace
     return 0;                                     \
   }
 
-  MANDEL_INLINE int mandelbrot_avx (__m256 cx[4], __m256 cy[4])
+  MANDEL_TARGET_AVX MANDEL_INLINE std::uint32_t mandelbrot_avx (__m256 cx[4], __m256 cy[4], std::uint32_t max_iter)
   {
 
     __m256  x[4] {cx[0], cx[1], cx[2], cx[3]};
     __m256  y[4] {cy[0], cy[1], cy[2], cy[3]};
-    __m256 x2[4];
-    __m256 y2[4];
+    __m256 x2[4] {};
+    __m256 y2[4] {};
     __m256 xy[4];
 
-    // 6 * 8 + 2 => 50 iterations
-    for (auto iter = 6; iter > 0; --iter)
+    // max_iter / 8 * 8 + max_iter % 8 => max_iter iterations
+    for (auto iter = max_iter / 8; iter > 0; --iter)
     {
       // 8 inner steps
       MANDEL_ITERATION();
@@ -173,26 +96,28 @@ namespace
       MANDEL_CHECKINF();
     }
 
-    // Last 2 steps
-    MANDEL_ITERATION();
-    MANDEL_ITERATION();
+    // Last steps
+    for (auto iter = max_iter % 8; iter > 0; --iter)
+    {
+      MANDEL_ITERATION();
+    }
 
     MANDEL_CMPMASK();
 
     return cmp_mask;
   }
 
-  MANDEL_INLINE int mandelbrot_avx_full (__m256 cx[4], __m256 cy[4])
+  MANDEL_TARGET_AVX MANDEL_INLINE std::uint32_t mandelbrot_avx_full (__m256 cx[4], __m256 cy[4], std::uint32_t max_iter)
   {
 
     __m256  x[4] {cx[0], cx[1], cx[2], cx[3]};
     __m256  y[4] {cy[0], cy[1], cy[2], cy[3]};
-    __m256 x2[4];
-    __m256 y2[4];
+    __m256 x2[4] {};
+    __m256 y2[4] {};
     __m256 xy[4];
 
-    // 6 * 8 + 2 => 50 iterations
-    for (auto iter = 6; iter > 0; --iter)
+    // max_iter / 8 * 8 + max_iter % 8 => max_iter iterations
+    for (auto iter = max_iter / 8; iter > 0; --iter)
     {
       // 8 inner steps
       MANDEL_ITERATION();
@@ -205,101 +130,89 @@ namespace
       MANDEL_ITERATION();
     }
 
-    // Last 2 steps
-    MANDEL_ITERATION();
-    MANDEL_ITERATION();
+    // Last steps
+    for (auto iter = max_iter % 8; iter > 0; --iter)
+    {
+      MANDEL_ITERATION();
+    }
 
     MANDEL_CMPMASK();
 
     return cmp_mask;
   }
 
-  bitmap::uptr compute_set (std::size_t const dim)
+  struct avx_kernel
   {
-    auto set      = create_bitmap (dim, dim);
-    auto width    = set->w;
-    auto pset     = set->bits ();
+    using kind = mandel::block_kind;
 
-    auto sdim     = static_cast<int> (dim);
+    static constexpr std::size_t rows = 4;
 
-    auto scale_x  = (max_x - min_x) / dim;
-    auto scale_y  = (max_y - min_y) / dim;
+    static char const * name () noexcept
+    {
+      return "float";
+    }
 
-    auto min_x_8  = _mm256_set1_ps (min_x);
-    auto scale_x_8= _mm256_set1_ps (scale_x);
-    auto shift_x_8= _mm256_set_ps (0, 1, 2, 3, 4, 5, 6, 7);
+    static bool supported () noexcept
+    {
+      return mandel::cpu_supports_avx ();
+    }
 
-    #pragma omp parallel for schedule(guided)
-    for (auto sy = 0; sy < sdim; sy += 4)
+    explicit avx_kernel (view const & v) noexcept
+      : max_iter  (v.max_iter)
+      , min_x     (static_cast<float> (v.min_x))
+      , min_y     (static_cast<float> (v.min_y))
+      , scale_x   ((static_cast<float> (v.max_x) - min_x) / v.x)
+      , scale_y   ((static_cast<float> (v.max_y) - min_y) / v.y)
     {
-      auto y                  = static_cast<std::size_t> (sy);
+    }
 
-      auto cy0                = _mm256_set1_ps (scale_y*y + min_y);
-      auto cy1                = _mm256_add_ps  (cy0, _mm256_set1_ps (1*scale_y));
-      auto cy2                = _mm256_add_ps  (cy0, _mm256_set1_ps (2*scale_y));
-      auto cy3                = _mm256_add_ps  (cy0, _mm256_set1_ps (3*scale_y));
+    MANDEL_TARGET_AVX void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const noexcept
+    {
+      auto min_x_8  = _mm256_set1_ps (min_x);
+      auto scale_x_8= _mm256_set1_ps (scale_x);
+      auto shift_x_8= _mm256_set_ps (0, 1, 2, 3, 4, 5, 6, 7);
 
-      auto yoffset            = width*y;
+      auto cy0      = _mm256_set1_ps (scale_y*y + min_y);
+      auto cy1      = _mm256_add_ps  (cy0, _mm256_set1_ps (1*scale_y));
+      auto cy2      = _mm256_add_ps  (cy0, _mm256_set1_ps (2*scale_y));
+      auto cy3      = _mm256_add_ps  (cy0, _mm256_set1_ps (3*scale_y));
 
-      auto last_reached_full  = false;
+      // Pixels next to ones inside the set are likely inside too, so they
+      //  skip the escape tests
+      auto full     = false;
 
-      for (auto w = 0U; w < width; ++w)
+      for (auto b = 0U; b < bytes; ++b)
       {
-        auto x    = w*8;
+        auto x    = (ww + b)*8;
         auto x_8  = _mm256_set1_ps (x);
         auto cx0  = _mm256_add_ps (min_x_8, _mm256_mul_ps (_mm256_add_ps (x_8, shift_x_8), scale_x_8));
         __m256 cx[] = { cx0, cx0, cx0, cx0 };
         __m256 cy[] = { cy0, cy1, cy2, cy3 };
         auto bits2  =
-          last_reached_full
-            ? mandelbrot_avx_full (cx, cy)
-            : mandelbrot_avx (cx, cy)
+          full
+            ? mandelbrot_avx_full (cx, cy, max_iter)
+            : mandelbrot_avx (cx, cy, max_iter)
             ;
 
-        pset[yoffset           + w] = 0xFF & bits2;
-        pset[yoffset + 1*width + w] = 0xFF & (bits2 >> 8);
-        pset[yoffset + 2*width + w] = 0xFF & (bits2 >> 16);
-        pset[yoffset + 3*width + w] = 0xFF & (bits2 >> 24);
+        words[0] |= static_cast<std::uint64_t> (0xFF & (bits2      )) << 8*b;
+        words[1] |= static_cast<std::uint64_t> (0xFF & (bits2 >> 8 )) << 8*b;
+        words[2] |= static_cast<std::uint64_t> (0xFF & (bits2 >> 16)) << 8*b;
+        words[3] |= static_cast<std::uint64_t> (0xFF & (bits2 >> 24)) << 8*b;
 
-        last_reached_full = bits2 != 0;
+        full = bits2 != 0;
       }
     }
 
-    return set;
-  }
-
+  private:
+    std::uint32_t max_iter;
+    float         min_x   ;
+    float         min_y   ;
+    float         scale_x ;
+    float         scale_y ;
+  };
 }
 
 int main (int argc, char const * argv[])
 {
-  auto dim  = [argc, argv] ()
-  {
-    auto dim = argc > 1 ? atoi (argv[1]) : 0;
-    return dim > 0 ? dim : 200;
-  } ();
-
-  if (dim % 8 != 0)
-  {
-    std::printf ("Dimension must be modulo 8\n");
-    return 999;
-  }
-
-  std::printf ("Generating mandelbrot set %dx%d(50)\n", dim, dim);
-
-  auto res  = time_it ([dim] { return compute_set (dim); });
-
-  auto ms   = std::get<0> (res);
-  auto& set = std::get<1> (res);
-
-  std::printf ("  it took %lld ms\n", ms);
-
-  auto file = std::fopen ("mandelbrot_avx.pbm", "wb");
-
-  std::fprintf (file, "P4\n%d %d\n", dim, dim);
-  std::fwrite (set->bits (), 1, set->sz, file);
-
-  std::fclose (file);
-
-  return 0;
+  return mandel::run<avx_kernel> ("mandelbrot_avx", argc, argv);
 }
-
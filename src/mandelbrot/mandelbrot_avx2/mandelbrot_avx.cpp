@@ -14,102 +14,37 @@
 // limitations under the License.
 // ----------------------------------------------------------------------------------------------
 
-// g++ -g --std=c++14 -pipe -Wall -O3 -ffast-math -fno-finite-math-only -march=native -mavx -fopenmp mandelbrot_avx.cpp
+// g++ -g --std=c++14 -pipe -Wall -O3 -ffast-math -fno-finite-math-only -march=native -mavx -mavx2 -fopenmp mandelbrot_avx.cpp
+// Portable build, AVX kernels are selected at runtime:
+// g++ -g --std=c++14 -pipe -Wall -O3 -ffast-math -fno-finite-math-only -fopenmp mandelbrot_avx.cpp
+// Static build for tiny renders, startup dominates so skip the dynamic loader:
+// g++ --std=c++14 -pipe -Wall -O3 -ffast-math -fno-finite-math-only -march=native -fopenmp -static mandelbrot_avx.cpp
+//  ./a.out 200 auto 50 serial - > mandelbrot.pbm
 
 #include "stdafx.h"
 
-#include <cassert>
-#include <cstddef>
-#include <cstdio>
-#include <chrono>
-#include <memory>
-#include <tuple>
+// An orbit must round the same wherever its steps are computed, a
+//  render_session continues orbits with advance and has to land on the bits
+//  of a fresh render. Under -ffast-math GCC reassociates and fuses the steps
+//  of the first check, the 8 step chunks and the last steps each their own
+//  way, so orbits drifted apart after a few hundred steps. The steps keep
+//  their written order here, the engine's coordinates too.
+#if defined (__GNUC__) && !defined (__clang__)
+# pragma GCC optimize ("no-associative-math", "fp-contract=off")
+#endif
 
-#include <emmintrin.h>
-#include <immintrin.h>
+#include "../mandelbrot_engine/mandelbrot_engine.hpp"
 
-#ifdef _MSVC_LANG
-# define MANDEL_INLINE __forceinline
-#else
-# define MANDEL_INLINE inline
-#endif
+#include <atomic>
+#include <cassert>
+#include <memory>
 
 namespace
 {
-  constexpr auto    min_x    = -1.5;
-  constexpr auto    min_y    = -1.0;
-  constexpr auto    max_x    =  0.5;
-  constexpr auto    max_y    =  1.0;
-
-  template<typename T>
-  auto time_it (T a)
-  {
-    auto before = std::chrono::high_resolution_clock::now ();
-    auto result = a ();
-    auto after  = std::chrono::high_resolution_clock::now ();
-    auto diff   = std::chrono::duration_cast<std::chrono::milliseconds> (after - before).count ();
-    return std::make_tuple (diff, std::move (result));
-  }
-
-
-  struct bitmap
-  {
-    using uptr = std::unique_ptr<bitmap>;
-
-    std::size_t const x ;
-    std::size_t const y ;
-    std::size_t const w ;
-    std::size_t const sz;
-
-    bitmap (std::size_t x, std::size_t y) noexcept
-      : x   (x)
-      , y   (y)
-      , w   ((x + 7) / 8)
-      , sz  (w*y)
-    {
-      b = static_cast<std::uint8_t*> (malloc(sz));
-    }
-
-    ~bitmap () noexcept
-    {
-      free (b);
-      b = nullptr;
-    }
-
-    bitmap (bitmap && bm) noexcept
-      : x   (bm.x)
-      , y   (bm.y)
-      , w   (bm.w)
-      , b   (bm.b)
-      , sz  (bm.sz)
-    {
-      bm.b = nullptr;
-    }
-
-    bitmap (bitmap const &)             = delete;
-    bitmap& operator= (bitmap const &)  = delete;
-    bitmap& operator= (bitmap &&)       = delete;
-
-    std::uint8_t * bits () noexcept
-    {
-      assert (b);
-      return b;
-    }
-
-    std::uint8_t const * bits () const noexcept
-    {
-      assert (b);
-      return b;
-    }
-
-  private:
-    std::uint8_t * b;
-  };
-
-  bitmap::uptr create_bitmap (std::size_t x, std::size_t y)
-  {
-    return std::make_unique<bitmap> (x, y);
-  }
+  using mandel::bitmap;
+  using mandel::lane_stats;
+  using mandel::pixel_queue;
+  using mandel::view;
 
 #define MANDEL_INDEPENDENT(i)                                         \
         xy[i] = _mm256_mul_pd (x[i], y[i]);                           \
@@ -149,16 +84,27 @@ namespace
     return 0;                                     \
   }
 
-  MANDEL_INLINE std::uint32_t mandelbrot_avx (__m256d cx[4], __m256d cy[4])
+  MANDEL_TARGET_AVX MANDEL_INLINE std::uint32_t mandelbrot_avx (__m256d cx[4], __m256d cy[4], std::uint32_t max_iter)
   {
     __m256d  x[4] {cx[0], cx[1], cx[2], cx[3]};
     __m256d  y[4] {cy[0], cy[1], cy[2], cy[3]};
-    __m256d x2[4];
-    __m256d y2[4];
+    __m256d x2[4] {};
+    __m256d y2[4] {};
     __m256d xy[4];
 
-    // 6 * 8 + 2 => 50 iterations
-    for (auto iter = 6; iter > 0; --iter)
+    // Most pixels around the set escape in the first steps
+    if (max_iter > 8)
+    {
+      MANDEL_ITERATION();
+      MANDEL_ITERATION();
+
+      MANDEL_CHECKINF();
+
+      max_iter -= 2;
+    }
+
+    // max_iter / 8 * 8 + max_iter % 8 => max_iter iterations
+    for (auto iter = max_iter / 8; iter > 0; --iter)
     {
       // 8 inner steps
       MANDEL_ITERATION();
@@ -173,26 +119,257 @@ namespace
       MANDEL_CHECKINF();
     }
 
-    // Last 2 steps
-    MANDEL_ITERATION();
-    MANDEL_ITERATION();
+    // Last steps
+    for (auto iter = max_iter % 8; iter > 0; --iter)
+    {
+      MANDEL_ITERATION();
+    }
 
     MANDEL_CMPMASK();
 
     return cmp_mask;
   }
 
-  MANDEL_INLINE std::uint32_t mandelbrot_avx_full (__m256d cx[4], __m256d cy[4])
+  // As mandelbrot_avx for each of levels ascending limits, the orbits run
+  //  once to the last limit and masks[l] is taken as they pass limits[l].
+  //  Returns the mask of the last limit, masks left when every point has
+  //  escaped keep the zeros of the caller.
+  MANDEL_TARGET_AVX MANDEL_INLINE std::uint32_t mandelbrot_avx_levels (__m256d cx[4], __m256d cy[4], std::uint32_t const * limits, std::size_t levels, std::uint32_t * masks)
+  {
+    __m256d  x[4] {cx[0], cx[1], cx[2], cx[3]};
+    __m256d  y[4] {cy[0], cy[1], cy[2], cy[3]};
+    __m256d x2[4] {};
+    __m256d y2[4] {};
+    __m256d xy[4];
+
+    auto done = 0U;
+
+    if (limits[0] > 8)
+    {
+      MANDEL_ITERATION();
+      MANDEL_ITERATION();
+
+      MANDEL_CHECKINF();
+
+      done = 2;
+    }
+
+    for (auto l = 0U; l < levels; ++l)
+    {
+      auto steps  = limits[l] - done;
+      done        = limits[l];
+
+      // The 8 step checks of mandelbrot_avx, a limit between two checks
+      //  takes its mask after the last steps
+      for (auto iter = steps / 8; iter > 0; --iter)
+      {
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+
+        MANDEL_CHECKINF();
+      }
+
+      for (auto iter = steps % 8; iter > 0; --iter)
+      {
+        MANDEL_ITERATION();
+      }
+
+      MANDEL_CMPMASK();
+
+      masks[l] = cmp_mask;
+    }
+
+    return masks[levels - 1];
+  }
+
+  struct avx_kernel
+  {
+    using kind = mandel::block_kind;
+
+    static constexpr std::size_t rows = 2;
+
+    static char const * name () noexcept
+    {
+      return "block";
+    }
+
+    static bool supported () noexcept
+    {
+      return mandel::cpu_supports_avx ();
+    }
+
+    explicit avx_kernel (view const & v) noexcept
+      : v (v)
+    {
+    }
+
+    // Every byte goes through mandelbrot_avx. A copy without the escape
+    //  tests for bytes after inside pixels saved little, and under
+    //  -ffast-math the compiler fused its multiplies and adds differently,
+    //  so some long orbits rounded differently depending on the previous
+    //  byte.
+    MANDEL_TARGET_AVX void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const noexcept
+    {
+      auto min_x_4    = _mm256_set1_pd (v.min_x);
+      auto scale_x_4  = _mm256_set1_pd (v.scale_x);
+      auto lshift_x_4 = _mm256_set_pd (0, 1, 2, 3);
+      auto ushift_x_4 = _mm256_set_pd (4, 5, 6, 7);
+
+      auto cy0        = _mm256_set1_pd (v.scale_y*y       + v.min_y);
+      auto cy1        = _mm256_set1_pd (v.scale_y*(y + 1) + v.min_y);
+
+      for (auto b = 0U; b < bytes; ++b)
+      {
+        auto x    = (ww + b)*8;
+        auto x_8  = _mm256_set1_pd (x);
+        auto cx0  = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, lshift_x_4), scale_x_4));
+        auto cx1  = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, ushift_x_4), scale_x_4));
+        __m256d cx[4] { cx0, cx1, cx0, cx1 };
+        __m256d cy[4] { cy0, cy0, cy1, cy1 };
+        auto bits = mandelbrot_avx (cx, cy, v.max_iter);
+
+        words[0] |= static_cast<std::uint64_t> (0xFF & (bits     )) << 8*b;
+        words[1] |= static_cast<std::uint64_t> (0xFF & (bits >> 8)) << 8*b;
+      }
+    }
+
+    MANDEL_TARGET_AVX void compute_levels (std::size_t y, std::size_t ww, std::size_t bytes, std::uint32_t const * limits, std::size_t levels, std::uint64_t * words) const noexcept
+    {
+      auto min_x_4    = _mm256_set1_pd (v.min_x);
+      auto scale_x_4  = _mm256_set1_pd (v.scale_x);
+      auto lshift_x_4 = _mm256_set_pd (0, 1, 2, 3);
+      auto ushift_x_4 = _mm256_set_pd (4, 5, 6, 7);
+
+      auto cy0        = _mm256_set1_pd (v.scale_y*y       + v.min_y);
+      auto cy1        = _mm256_set1_pd (v.scale_y*(y + 1) + v.min_y);
+
+      for (auto b = 0U; b < bytes; ++b)
+      {
+        auto x    = (ww + b)*8;
+        auto x_8  = _mm256_set1_pd (x);
+        auto cx0  = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, lshift_x_4), scale_x_4));
+        auto cx1  = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, ushift_x_4), scale_x_4));
+        __m256d cx[4] { cx0, cx1, cx0, cx1 };
+        __m256d cy[4] { cy0, cy0, cy1, cy1 };
+
+        std::uint32_t masks[mandel::max_levels] {};
+        mandelbrot_avx_levels (cx, cy, limits, levels, masks);
+
+        for (auto l = 0U; l < levels; ++l)
+        {
+          words[l*rows    ] |= static_cast<std::uint64_t> (0xFF & (masks[l]     )) << 8*b;
+          words[l*rows + 1] |= static_cast<std::uint64_t> (0xFF & (masks[l] >> 8)) << 8*b;
+        }
+      }
+    }
+
+    // Bit i is set if point i is inside
+    MANDEL_TARGET_AVX std::uint32_t query_inside (double const * pcx, double const * pcy) const noexcept
+    {
+      // Loaded so MANDEL_CMPMASK puts point i in bit i
+      __m256d cx[4] { _mm256_loadu_pd (pcx + 4), _mm256_loadu_pd (pcx), _mm256_loadu_pd (pcx + 12), _mm256_loadu_pd (pcx + 8) };
+      __m256d cy[4] { _mm256_loadu_pd (pcy + 4), _mm256_loadu_pd (pcy), _mm256_loadu_pd (pcy + 12), _mm256_loadu_pd (pcy + 8) };
+
+      return mandelbrot_avx (cx, cy, v.max_iter);
+    }
+
+    // Bit i is set if point i hasn't escaped after steps more steps
+    MANDEL_TARGET_AVX std::uint32_t advance (double const * pcx, double const * pcy, double * px, double * py, std::uint32_t steps) const noexcept
+    {
+      __m256d cx[4] { _mm256_loadu_pd (pcx + 4), _mm256_loadu_pd (pcx), _mm256_loadu_pd (pcx + 12), _mm256_loadu_pd (pcx + 8) };
+      __m256d cy[4] { _mm256_loadu_pd (pcy + 4), _mm256_loadu_pd (pcy), _mm256_loadu_pd (pcy + 12), _mm256_loadu_pd (pcy + 8) };
+      __m256d  x[4] { _mm256_loadu_pd (px + 4) , _mm256_loadu_pd (px) , _mm256_loadu_pd (px + 12) , _mm256_loadu_pd (px + 8)  };
+      __m256d  y[4] { _mm256_loadu_pd (py + 4) , _mm256_loadu_pd (py) , _mm256_loadu_pd (py + 12) , _mm256_loadu_pd (py + 8)  };
+      __m256d x2[4] {};
+      __m256d y2[4] {};
+      __m256d xy[4];
+
+      // Orbits that all escaped aren't stored, they are dropped
+      for (auto iter = steps / 8; iter > 0; --iter)
+      {
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+        MANDEL_ITERATION();
+
+        MANDEL_CHECKINF();
+      }
+
+      for (auto iter = steps % 8; iter > 0; --iter)
+      {
+        MANDEL_ITERATION();
+      }
+
+      _mm256_storeu_pd (px + 4 , x[0]);
+      _mm256_storeu_pd (px     , x[1]);
+      _mm256_storeu_pd (px + 12, x[2]);
+      _mm256_storeu_pd (px + 8 , x[3]);
+      _mm256_storeu_pd (py + 4 , y[0]);
+      _mm256_storeu_pd (py     , y[1]);
+      _mm256_storeu_pd (py + 12, y[2]);
+      _mm256_storeu_pd (py + 8 , y[3]);
+
+      MANDEL_CMPMASK();
+
+      return cmp_mask;
+    }
+
+  private:
+    view v;
+  };
+
+  // Lane counting kernel
+  //  The block kernel pairs byte b of row y with byte b of row y + 1. When one
+  //  of them escapes at once and the other runs long, half the lanes idle
+  //  until the block is done. This kernel computes the same blocks and counts
+  //  the lane steps run and those of pixels not yet escaped, see stats ().
+  //  Steps after the last check count too.
+  //
+  //  Pairing the bytes of a word by the costs the row pair above had
+  //  instead was tried. At 2000x2000 and max_iter 1000 it kept 94-96% of the
+  //  lanes busy like this pairing, over the whole set, a boundary and the
+  //  real axis near -1.75, and ran no faster than the block kernel:
+  //  vertical neighbours rarely differ enough in cost to regroup.
+
+  MANDEL_INLINE std::uint32_t lane_count (std::uint32_t mask) noexcept
+  {
+    // Nibble table, popcnt isn't in the baseline instruction set
+    static std::uint8_t const bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    return bits[mask & 0xF] + bits[(mask >> 4) & 0xF];
+  }
+
+#define MANDEL_HALF_ALIVE(i, j) \
+  static_cast<std::uint32_t> (_mm256_movemask_pd (MANDEL_CMP (i)) | (_mm256_movemask_pd (MANDEL_CMP (j)) << 4))
+
+  // As mandelbrot_avx, chains 0 and 1 hold the first byte and chains 2 and 3
+  //  the second. Adds the steps run to steps and, for each step, the lanes
+  //  alive at the start of its chunk to lanes.
+  MANDEL_TARGET_AVX MANDEL_INLINE std::uint32_t mandelbrot_avx_lanes (__m256d cx[4], __m256d cy[4], std::uint32_t max_iter, std::uint32_t & steps, std::uint32_t & lanes)
   {
     __m256d  x[4] {cx[0], cx[1], cx[2], cx[3]};
     __m256d  y[4] {cy[0], cy[1], cy[2], cy[3]};
-    __m256d x2[4];
-    __m256d y2[4];
+    __m256d x2[4] {};
+    __m256d y2[4] {};
     __m256d xy[4];
 
-    // 6 * 8 + 2 => 50 iterations
-    for (auto iter = 6; iter > 0; --iter)
+    auto alive0 = 0xFFU;
+    auto alive1 = 0xFFU;
+
+    for (auto iter = max_iter / 8; iter > 0; --iter)
     {
+      steps += 8;
+      lanes += 8*(lane_count (alive0) + lane_count (alive1));
+
       // 8 inner steps
       MANDEL_ITERATION();
       MANDEL_ITERATION();
@@ -202,101 +379,1092 @@ namespace
       MANDEL_ITERATION();
       MANDEL_ITERATION();
       MANDEL_ITERATION();
+
+      // An escaped lane may come back under 4 once it overflows to NaN
+      alive0 &= MANDEL_HALF_ALIVE (0, 1);
+      alive1 &= MANDEL_HALF_ALIVE (2, 3);
+      if (!alive0 && !alive1)
+      {
+        return 0;
+      }
     }
 
-    // Last 2 steps
-    MANDEL_ITERATION();
-    MANDEL_ITERATION();
+    // Last steps
+    steps += max_iter % 8;
+    lanes += (max_iter % 8)*(lane_count (alive0) + lane_count (alive1));
+    for (auto iter = max_iter % 8; iter > 0; --iter)
+    {
+      MANDEL_ITERATION();
+    }
 
     MANDEL_CMPMASK();
 
     return cmp_mask;
   }
 
-  bitmap::uptr compute_set (std::size_t const dim)
+  struct lane_kernel
   {
-    auto set        = create_bitmap (dim, dim);
-    auto width      = set->w;
-    auto pset       = set->bits ();
+    using kind = mandel::block_kind;
 
-    auto sdim       = static_cast<int> (dim);
+    static constexpr std::size_t rows = 2;
 
-    auto scale_x    = (max_x - min_x) / dim;
-    auto scale_y    = (max_y - min_y) / dim;
+    static char const * name () noexcept
+    {
+      return "lanes";
+    }
 
-    auto min_x_4    = _mm256_set1_pd (min_x);
-    auto scale_x_4  = _mm256_set1_pd (scale_x);
-    auto lshift_x_4 = _mm256_set_pd (0, 1, 2, 3);
-    auto ushift_x_4 = _mm256_set_pd (4, 5, 6, 7);
+    static bool supported () noexcept
+    {
+      return mandel::cpu_supports_avx ();
+    }
 
-    #pragma omp parallel for schedule(guided)
-    for (auto sy = 0; sy < sdim; sy += 2)
+    explicit lane_kernel (view const & v)
+      : v         (v)
+      , counters  (std::make_unique<lane_counters> ())
     {
-      auto y                  = static_cast<std::size_t> (sy);
+    }
 
-      auto cy0                = _mm256_set1_pd (scale_y*y       + min_y);
-      auto cy1                = _mm256_set1_pd (scale_y*(y + 1) + min_y);
+    MANDEL_TARGET_AVX void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const noexcept
+    {
+      auto min_x_4    = _mm256_set1_pd (v.min_x);
+      auto scale_x_4  = _mm256_set1_pd (v.scale_x);
+      auto lshift_x_4 = _mm256_set_pd (0, 1, 2, 3);
+      auto ushift_x_4 = _mm256_set_pd (4, 5, 6, 7);
 
-      auto yoffset            = width*y;
+      auto cy0        = _mm256_set1_pd (v.scale_y*y       + v.min_y);
+      auto cy1        = _mm256_set1_pd (v.scale_y*(y + 1) + v.min_y);
 
-      auto last_reached_full  = false;
+      std::uint64_t steps_run   = 0;
+      std::uint64_t lane_steps  = 0;
 
-      for (auto w = 0U; w < width; ++w)
+      for (auto b = 0U; b < bytes; ++b)
       {
-        auto x    = w*8;
-        auto x_8  = _mm256_set1_pd (x);
+        auto x_8  = _mm256_set1_pd ((ww + b)*8);
         auto cx0  = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, lshift_x_4), scale_x_4));
         auto cx1  = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, ushift_x_4), scale_x_4));
         __m256d cx[4] { cx0, cx1, cx0, cx1 };
         __m256d cy[4] { cy0, cy0, cy1, cy1 };
-        auto bits =
-          last_reached_full
-            ? mandelbrot_avx_full (cx, cy)
-            : mandelbrot_avx (cx, cy)
-            ;
 
-        pset[yoffset          + w] = 0xFF & (bits     );
-        pset[yoffset + width  + w] = 0xFF & (bits >> 8);
+        std::uint32_t steps = 0;
+        std::uint32_t lanes = 0;
+        auto bits = mandelbrot_avx_lanes (cx, cy, v.max_iter, steps, lanes);
 
-        last_reached_full = bits != 0;
+        words[0] |= static_cast<std::uint64_t> (0xFF & (bits     )) << 8*b;
+        words[1] |= static_cast<std::uint64_t> (0xFF & (bits >> 8)) << 8*b;
+
+        steps_run   += steps;
+        lane_steps  += lanes;
       }
+
+      counters->lane_steps.fetch_add (16*steps_run, std::memory_order_relaxed);
+      counters->useful_steps.fetch_add (lane_steps, std::memory_order_relaxed);
     }
 
-    return set;
+    // Lane steps run, a lane is useful until the check after its pixel
+    //  escaped
+    lane_stats stats () const noexcept
+    {
+      return lane_stats
+      {
+        counters->lane_steps.load ()
+      , counters->useful_steps.load ()
+      };
+    }
+
+  private:
+    struct lane_counters
+    {
+      std::atomic<std::uint64_t> lane_steps   {0};
+      std::atomic<std::uint64_t> useful_steps {0};
+    };
+
+    view                            v       ;
+    std::unique_ptr<lane_counters>  counters;
+  };
+
+  // Streaming kernel
+  //  The block kernel above keeps all 16 lanes busy until the slowest pixel in
+  //  the block has escaped. The streaming kernel instead retires a lane as soon
+  //  as its pixel is resolved and refills it with the next pixel from the
+  //  worker's queue.
+
+#define MANDEL_COUNT(i)                                               \
+        cnt[i] = _mm256_add_pd (cnt[i], _mm256_and_pd (MANDEL_CMP (i), one_4));
+
+#define MANDEL_STREAM_ITERATION()   \
+    MANDEL_INDEPENDENT(0)           \
+    MANDEL_COUNT(0)                 \
+    MANDEL_DEPENDENT(0)             \
+    MANDEL_INDEPENDENT(1)           \
+    MANDEL_COUNT(1)                 \
+    MANDEL_DEPENDENT(1)             \
+    MANDEL_INDEPENDENT(2)           \
+    MANDEL_COUNT(2)                 \
+    MANDEL_DEPENDENT(2)             \
+    MANDEL_INDEPENDENT(3)           \
+    MANDEL_COUNT(3)                 \
+    MANDEL_DEPENDENT(3)
+
+#define MANDEL_STREAM_LOAD()                          \
+  for (auto i = 0U; i < 4U; ++i)                      \
+  {                                                   \
+    x[i]    = _mm256_load_pd (sx   + 4*i);            \
+    y[i]    = _mm256_load_pd (sy   + 4*i);            \
+    cx[i]   = _mm256_load_pd (scx  + 4*i);            \
+    cy[i]   = _mm256_load_pd (scy  + 4*i);            \
+    cnt[i]  = _mm256_load_pd (scnt + 4*i);            \
   }
 
-}
+#define MANDEL_STREAM_STORE()                         \
+  for (auto i = 0U; i < 4U; ++i)                      \
+  {                                                   \
+    _mm256_store_pd (sx   + 4*i, x[i]  );             \
+    _mm256_store_pd (sy   + 4*i, y[i]  );             \
+    _mm256_store_pd (scnt + 4*i, cnt[i]);             \
+  }
 
-int main (int argc, char const * argv[])
-{
-  auto dim  = [argc, argv] ()
+  struct stream_kernel
   {
-    auto dim = argc > 1 ? atoi (argv[1]) : 0;
-    return dim > 0 ? dim : 200;
-  } ();
+    using kind = mandel::stream_kind;
 
-  if (dim % 8 != 0)
+    static char const * name () noexcept
+    {
+      return "stream";
+    }
+
+    static bool supported () noexcept
+    {
+      return mandel::cpu_supports_avx ();
+    }
+
+    explicit stream_kernel (view const & v) noexcept
+      : v (v)
+    {
+    }
+
+    MANDEL_TARGET_AVX lane_stats compute_stream (bitmap & set, pixel_queue & queue) const
+    {
+      constexpr auto lanes  = 16U;
+      constexpr auto idle   = ~std::size_t ();
+
+      auto pset       = set.bits ();
+      auto width      = set.w;
+      auto max_iter   = v.max_iter;
+
+      auto one_4      = _mm256_set1_pd (1.0);
+      auto max_iter_4 = _mm256_set1_pd (max_iter);
+
+      // Lane l lives in chain l/4, element l%4
+      alignas (32) double sx  [lanes] {};
+      alignas (32) double sy  [lanes] {};
+      alignas (32) double scx [lanes] {};
+      alignas (32) double scy [lanes] {};
+      alignas (32) double scnt[lanes] {};
+      std::size_t         spx [lanes] ;
+      std::size_t         spy [lanes] ;
+
+      auto stats  = lane_stats {};
+      auto active = 0U;
+
+      // Retires the pixel in lane l (if any) and refills the lane from the queue
+      auto refill = [&] (std::uint32_t l)
+      {
+        if (spx[l] != idle)
+        {
+          auto cnt = static_cast<std::uint32_t> (scnt[l]);
+          if (cnt >= max_iter)
+          {
+            pset[spy[l]*width + spx[l]/8] |= 0x80U >> (spx[l] % 8);
+          }
+          stats.useful_steps += std::min (cnt + 1, max_iter);
+        }
+
+        std::size_t px;
+        std::size_t py;
+        if (queue.pop (px, py))
+        {
+          auto cx = v.scale_x*px + v.min_x;
+          auto cy = v.scale_y*py + v.min_y;
+          sx[l]   = scx[l] = cx;
+          sy[l]   = scy[l] = cy;
+          scnt[l] = 0;
+          spx[l]  = px;
+          spy[l]  = py;
+          active  |= 1U << l;
+        }
+        else
+        {
+          // Parks the lane on a point that stays bounded
+          sx[l]   = scx[l] = 0;
+          sy[l]   = scy[l] = 0;
+          spx[l]  = idle;
+          active  &= ~(1U << l);
+        }
+      };
+
+      for (auto l = 0U; l < lanes; ++l)
+      {
+        spx[l] = idle;
+        refill (l);
+      }
+
+      __m256d  x[4];
+      __m256d  y[4];
+      __m256d cx[4];
+      __m256d cy[4];
+      __m256d cnt[4];
+      __m256d x2[4];
+      __m256d y2[4];
+      __m256d xy[4];
+
+      MANDEL_STREAM_LOAD();
+
+      while (active)
+      {
+        // 8 inner steps between retirement checks
+        MANDEL_STREAM_ITERATION();
+        MANDEL_STREAM_ITERATION();
+        MANDEL_STREAM_ITERATION();
+        MANDEL_STREAM_ITERATION();
+        MANDEL_STREAM_ITERATION();
+        MANDEL_STREAM_ITERATION();
+        MANDEL_STREAM_ITERATION();
+        MANDEL_STREAM_ITERATION();
+
+        stats.lane_steps += 8*lanes;
+
+        // A lane is resolved when it has escaped or reached max_iter
+        std::uint32_t inside  = 0;
+        std::uint32_t reached = 0;
+        for (auto i = 0U; i < 4U; ++i)
+        {
+          inside  |= _mm256_movemask_pd (MANDEL_CMP (i)) << 4*i;
+          reached |= _mm256_movemask_pd (_mm256_cmp_pd (cnt[i], max_iter_4, _CMP_GE_OQ)) << 4*i;
+        }
+
+        auto resolved = (~inside | reached) & active;
+        if (!resolved)
+        {
+          continue;
+        }
+
+        MANDEL_STREAM_STORE();
+        for (; resolved; resolved &= resolved - 1)
+        {
+          refill (mandel::lowest_bit (resolved));
+        }
+        MANDEL_STREAM_LOAD();
+      }
+
+      return stats;
+    }
+
+  private:
+    view v;
+  };
+
+  // Escape count kernel
+  //  Counts the steps each pixel stays inside, 16 pixels of a tile row at a
+  //  time using the counting iteration of the streaming kernel. Escaped
+  //  pixels never count again so the loop leaves once all 16 have escaped.
+  //  The counts are added to cnt.
+
+  MANDEL_TARGET_AVX MANDEL_INLINE void mandelbrot_counts (__m256d cx[4], __m256d cy[4], std::uint32_t max_iter, __m256d cnt[4])
   {
-    std::printf ("Dimension must be modulo 8\n");
-    return 999;
+    auto one_4 = _mm256_set1_pd (1.0);
+
+    __m256d   x[4] {cx[0], cx[1], cx[2], cx[3]};
+    __m256d   y[4] {cy[0], cy[1], cy[2], cy[3]};
+    __m256d  x2[4] {};
+    __m256d  y2[4] {};
+    __m256d  xy[4];
+
+    auto iter = max_iter / 8;
+    for (; iter > 0; --iter)
+    {
+      // 8 inner steps
+      MANDEL_STREAM_ITERATION();
+      MANDEL_STREAM_ITERATION();
+      MANDEL_STREAM_ITERATION();
+      MANDEL_STREAM_ITERATION();
+      MANDEL_STREAM_ITERATION();
+      MANDEL_STREAM_ITERATION();
+      MANDEL_STREAM_ITERATION();
+      MANDEL_STREAM_ITERATION();
+
+      auto cont = _mm256_movemask_pd (_mm256_or_pd (
+          _mm256_or_pd (MANDEL_CMP(0), MANDEL_CMP(1))
+        , _mm256_or_pd (MANDEL_CMP(2), MANDEL_CMP(3))
+        ));
+      if (!cont)
+      {
+        break;
+      }
+    }
+
+    // Last steps, unless all have escaped
+    if (iter == 0)
+    {
+      for (iter = max_iter % 8; iter > 0; --iter)
+      {
+        MANDEL_STREAM_ITERATION();
+      }
+    }
   }
 
-  std::printf ("Generating mandelbrot set %dx%d(50)\n", dim, dim);
+  struct count_kernel
+  {
+    using kind = mandel::count_kind;
+
+    static char const * name () noexcept
+    {
+      return "counts";
+    }
+
+    static bool supported () noexcept
+    {
+      return mandel::cpu_supports_avx ();
+    }
 
-  auto res  = time_it ([dim] { return compute_set (dim); });
+    explicit count_kernel (view const & v) noexcept
+      : v (v)
+    {
+    }
 
-  auto ms   = std::get<0> (res);
-  auto& set = std::get<1> (res);
+    MANDEL_TARGET_AVX void compute_tile (mandel::tile const & t, std::uint16_t * counts) const noexcept
+    {
+      auto min_x_4    = _mm256_set1_pd (v.min_x);
+      auto scale_x_4  = _mm256_set1_pd (v.scale_x);
+      auto shift_x_4  = _mm256_set_pd (3, 2, 1, 0);
 
-  std::printf ("  it took %lld ms\n", ms);
+      for (auto r = 0U; r < t.h; ++r)
+      {
+        auto cy_4 = _mm256_set1_pd (v.scale_y*(t.y0 + r) + v.min_y);
+        __m256d cy[4] { cy_4, cy_4, cy_4, cy_4 };
 
-  auto file = std::fopen ("mandelbrot_avx2.pbm", "wb");
+        for (auto c = 0U; c < t.w; c += 16)
+        {
+          __m256d cx[4];
+          for (auto i = 0U; i < 4U; ++i)
+          {
+            auto x_4  = _mm256_set1_pd (t.x0 + c + 4*i);
+            cx[i]     = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_4, shift_x_4), scale_x_4));
+          }
 
-  std::fprintf (file, "P4\n%d %d\n", dim, dim);
-  std::fwrite (set->bits (), 1, set->sz, file);
+          __m256d cnt[4] {};
+          mandelbrot_counts (cx, cy, v.max_iter, cnt);
 
-  std::fclose (file);
+          // Counts above 65535 saturate
+          auto p = counts + r*mandel::tile_dim + c;
+          for (auto i = 0U; i < 4U; i += 2)
+          {
+            auto lo = _mm256_cvttpd_epi32 (cnt[i]);
+            auto hi = _mm256_cvttpd_epi32 (cnt[i + 1]);
+            _mm_storeu_si128 (reinterpret_cast<__m128i *> (p + 4*i), _mm_packus_epi32 (lo, hi));
+          }
+        }
+      }
+    }
 
-  return 0;
+    // counts[i] is the escape count of point i, max_iter if inside
+    MANDEL_TARGET_AVX void query_counts (double const * pcx, double const * pcy, std::uint32_t * counts) const noexcept
+    {
+      __m256d cx[4];
+      __m256d cy[4];
+      for (auto i = 0U; i < 4U; ++i)
+      {
+        cx[i] = _mm256_loadu_pd (pcx + 4*i);
+        cy[i] = _mm256_loadu_pd (pcy + 4*i);
+      }
+
+      __m256d cnt[4] {};
+      mandelbrot_counts (cx, cy, v.max_iter, cnt);
+
+      for (auto i = 0U; i < 4U; ++i)
+      {
+        _mm_storeu_si128 (reinterpret_cast<__m128i *> (counts + 4*i), _mm256_cvttpd_epi32 (cnt[i]));
+      }
+    }
+
+    // Steps the orbits of 16 points and stores z before every step, the
+    //  escaped ones are left running
+    MANDEL_TARGET_AVX void trace (double const * pcx, double const * pcy, double * px, double * py, std::uint32_t steps, double * tx, double * ty) const noexcept
+    {
+      __m256d cx[4];
+      __m256d cy[4];
+      __m256d  x[4];
+      __m256d  y[4];
+      for (auto i = 0U; i < 4U; ++i)
+      {
+        cx[i] = _mm256_loadu_pd (pcx + 4*i);
+        cy[i] = _mm256_loadu_pd (pcy + 4*i);
+        x[i]  = _mm256_loadu_pd (px + 4*i);
+        y[i]  = _mm256_loadu_pd (py + 4*i);
+      }
+      __m256d x2[4];
+      __m256d y2[4];
+      __m256d xy[4];
+
+      for (auto s = 0U; s < steps; ++s)
+      {
+        for (auto i = 0U; i < 4U; ++i)
+        {
+          _mm256_storeu_pd (tx + s*mandel::query_group + 4*i, x[i]);
+          _mm256_storeu_pd (ty + s*mandel::query_group + 4*i, y[i]);
+        }
+
+        MANDEL_ITERATION();
+      }
+
+      for (auto i = 0U; i < 4U; ++i)
+      {
+        _mm256_storeu_pd (px + 4*i, x[i]);
+        _mm256_storeu_pd (py + 4*i, y[i]);
+      }
+    }
+
+  private:
+    view v;
+  };
+
+  // Formula kernel
+  //  Iterates the formula given with --formula, compiled at runtime by
+  //  compile_formula, see formula_jit.hpp. The chains hold the pixels as in
+  //  the block kernel. The compiled code tests |z| after its last step while
+  //  MANDEL_CMPMASK tests the z before it, so it runs max_iter - 1 steps to
+  //  render the same pixels.
+
+  struct formula_kernel
+  {
+    using kind = mandel::block_kind;
+
+    static constexpr std::size_t rows = 2;
+
+    static char const * name () noexcept
+    {
+      return "formula";
+    }
+
+    // Also false if the formula can't be mapped executable, so a selected
+    //  kernel always has its program
+    static bool supported () noexcept
+    {
+      return
+            mandel::formula_jit_supported ()
+        &&  mandel::cpu_supports_avx ()
+        &&  mandel::shared_formula_program () != nullptr
+        ;
+    }
+
+    explicit formula_kernel (view const & v)
+      : v       (v)
+      , program (mandel::shared_formula_program ())
+    {
+      assert (program);
+    }
+
+    MANDEL_TARGET_AVX void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const noexcept
+    {
+      auto min_x_4    = _mm256_set1_pd (v.min_x);
+      auto scale_x_4  = _mm256_set1_pd (v.scale_x);
+      auto lshift_x_4 = _mm256_set_pd (0, 1, 2, 3);
+      auto ushift_x_4 = _mm256_set_pd (4, 5, 6, 7);
+
+      auto cy0        = _mm256_set1_pd (v.scale_y*y       + v.min_y);
+      auto cy1        = _mm256_set1_pd (v.scale_y*(y + 1) + v.min_y);
+
+      auto steps      = v.max_iter > 0 ? v.max_iter - 1 : 0;
+
+      // Chain k is bits 4k to 4k + 3, ordered as MANDEL_CMPMASK
+      alignas (32) double c[32];
+
+      for (auto b = 0U; b < bytes; ++b)
+      {
+        auto x    = (ww + b)*8;
+        auto x_8  = _mm256_set1_pd (x);
+        auto cx0  = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, lshift_x_4), scale_x_4));
+        auto cx1  = _mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, ushift_x_4), scale_x_4));
+
+        _mm256_store_pd (c     , cx1);
+        _mm256_store_pd (c +  4, cy0);
+        _mm256_store_pd (c +  8, cx0);
+        _mm256_store_pd (c + 12, cy0);
+        _mm256_store_pd (c + 16, cx1);
+        _mm256_store_pd (c + 20, cy1);
+        _mm256_store_pd (c + 24, cx0);
+        _mm256_store_pd (c + 28, cy1);
+
+        auto bits = program->run (c, steps);
+
+        words[0] |= static_cast<std::uint64_t> (0xFF & (bits     )) << 8*b;
+        words[1] |= static_cast<std::uint64_t> (0xFF & (bits >> 8)) << 8*b;
+      }
+    }
+
+  private:
+    view                                          v       ;
+    std::shared_ptr<mandel::formula_program const> program ;
+  };
+
+  // Hybrid kernel
+  //  A float register holds 8 lanes to the 4 of a double one, so the coarse
+  //  pass runs 32 pixels, 2 bytes of 2 rows, per block in float. Float goes
+  //  wrong where rounding errors have time to grow or decide a comparison
+  //  with 4, so a pixel is unsure if it escapes after hybrid_late steps or
+  //  if its |z|^2 is within hybrid_margin of 4 at a check. The engine also
+  //  treats pixels inside outside the main bulbs as unsure, a float orbit
+  //  may stay bounded where the double one escapes after 1000s of steps. It
+  //  refines the bytes with unsure pixels with the precise pass, the block
+  //  kernel.
+  //
+  //  An orbit escaping early in float could stay bounded in double, so the
+  //  early escapes are checked against the first hybrid_late steps of the
+  //  block kernel and are unsure unless those escape too. An orbit outside
+  //  |z| = 2 can't return, so the escaped bits then are those of the block
+  //  kernel. What is taken from float unchecked are pixels inside the main
+  //  bulbs, whose orbits settle far from |z| = 2.
+
+  constexpr auto hybrid_late    = 32U;
+  constexpr auto hybrid_margin  = 1E-3F;
+
+#define MANDEL_FLOAT_INDEPENDENT(i)                                   \
+        xy[i] = _mm256_mul_ps (x[i], y[i]);                           \
+        x2[i] = _mm256_mul_ps (x[i], x[i]);                           \
+        y2[i] = _mm256_mul_ps (y[i], y[i]);
+#define MANDEL_FLOAT_DEPENDENT(i)                                     \
+        y[i]  = _mm256_add_ps (_mm256_add_ps (xy[i], xy[i]) , cy[i]); \
+        x[i]  = _mm256_add_ps (_mm256_sub_ps (x2[i], y2[i]) , cx[i]);
+
+#define MANDEL_FLOAT_ITERATION()  \
+    MANDEL_FLOAT_INDEPENDENT(0)   \
+    MANDEL_FLOAT_DEPENDENT(0)     \
+    MANDEL_FLOAT_INDEPENDENT(1)   \
+    MANDEL_FLOAT_DEPENDENT(1)     \
+    MANDEL_FLOAT_INDEPENDENT(2)   \
+    MANDEL_FLOAT_DEPENDENT(2)     \
+    MANDEL_FLOAT_INDEPENDENT(3)   \
+    MANDEL_FLOAT_DEPENDENT(3)
+
+#define MANDEL_FLOAT_CMP(i) \
+  _mm256_cmp_ps (_mm256_add_ps (x2[i], y2[i]), _mm256_set1_ps (4.0F), _CMP_LE_OQ)
+
+#define MANDEL_FLOAT_NEAR(i)                                                              \
+  static_cast<std::uint32_t> (_mm256_movemask_ps (_mm256_and_ps (                         \
+      _mm256_cmp_ps (_mm256_add_ps (x2[i], y2[i]), low, _CMP_GE_OQ)                       \
+    , _mm256_cmp_ps (_mm256_add_ps (x2[i], y2[i]), high, _CMP_LE_OQ)                      \
+    )))
+
+  // Chain i holds one byte, bit 0 of its mask is lane 0. Sets inside[i] and
+  //  unsure[i] to the masks of the lanes inside and of those unsure.
+  MANDEL_TARGET_AVX MANDEL_INLINE void mandelbrot_float (__m256 cx[4], __m256 cy[4], std::uint32_t max_iter, std::uint32_t inside[4], std::uint32_t unsure[4])
+  {
+    auto low  = _mm256_set1_ps (4.0F*(1 - hybrid_margin));
+    auto high = _mm256_set1_ps (4.0F*(1 + hybrid_margin));
+
+    __m256  x[4] {cx[0], cx[1], cx[2], cx[3]};
+    __m256  y[4] {cy[0], cy[1], cy[2], cy[3]};
+    __m256 x2[4] {};
+    __m256 y2[4] {};
+    __m256 xy[4];
+
+    // Lanes alive after hybrid_late steps, all of them if it is never reached
+    std::uint32_t alive[4] { 0xFF, 0xFF, 0xFF, 0xFF };
+
+    for (auto i = 0U; i < 4U; ++i)
+    {
+      inside[i] = 0;
+      unsure[i] = 0;
+    }
+
+    auto step = 0U;
+    for (auto iter = max_iter / 8; iter > 0; --iter)
+    {
+      // 8 inner steps
+      MANDEL_FLOAT_ITERATION();
+      MANDEL_FLOAT_ITERATION();
+      MANDEL_FLOAT_ITERATION();
+      MANDEL_FLOAT_ITERATION();
+      MANDEL_FLOAT_ITERATION();
+      MANDEL_FLOAT_ITERATION();
+      MANDEL_FLOAT_ITERATION();
+      MANDEL_FLOAT_ITERATION();
+
+      step += 8;
+
+      std::uint32_t cmp[4] {
+        static_cast<std::uint32_t> (_mm256_movemask_ps (MANDEL_FLOAT_CMP (0)))
+      , static_cast<std::uint32_t> (_mm256_movemask_ps (MANDEL_FLOAT_CMP (1)))
+      , static_cast<std::uint32_t> (_mm256_movemask_ps (MANDEL_FLOAT_CMP (2)))
+      , static_cast<std::uint32_t> (_mm256_movemask_ps (MANDEL_FLOAT_CMP (3)))
+      };
+
+      for (auto i = 0U; i < 4U; ++i)
+      {
+        unsure[i] |= MANDEL_FLOAT_NEAR (i);
+      }
+
+      if (step == hybrid_late)
+      {
+        for (auto i = 0U; i < 4U; ++i)
+        {
+          alive[i] = cmp[i];
+        }
+      }
+
+      if ((cmp[0] | cmp[1] | cmp[2] | cmp[3]) == 0)
+      {
+        // Escaped before max_iter, unsure if after hybrid_late
+        if (step > hybrid_late)
+        {
+          for (auto i = 0U; i < 4U; ++i)
+          {
+            unsure[i] |= alive[i];
+          }
+        }
+        return;
+      }
+    }
+
+    // Last steps
+    for (auto iter = max_iter % 8; iter > 0; --iter)
+    {
+      MANDEL_FLOAT_ITERATION();
+    }
+
+    for (auto i = 0U; i < 4U; ++i)
+    {
+      inside[i] = static_cast<std::uint32_t> (_mm256_movemask_ps (MANDEL_FLOAT_CMP (i)));
+      unsure[i] |= MANDEL_FLOAT_NEAR (i) | (max_iter > hybrid_late ? alive[i] & ~inside[i] : 0U);
+    }
+  }
+
+  struct hybrid_kernel
+  {
+    using kind = mandel::hybrid_kind;
+
+    static constexpr std::size_t rows = avx_kernel::rows;
+
+    static char const * name () noexcept
+    {
+      return "hybrid";
+    }
+
+    static bool supported () noexcept
+    {
+      return mandel::cpu_supports_avx ();
+    }
+
+    explicit hybrid_kernel (view const & v) noexcept
+      : v       (v)
+      , precise (v)
+      , early   (first_steps (v))
+    {
+    }
+
+    // Floats resolve about 7 digits, the pixels must be well apart in them
+    bool coarse_usable () const noexcept
+    {
+      auto extent = std::max ({ std::abs (v.min_x), std::abs (v.max_x), std::abs (v.min_y), std::abs (v.max_y) });
+      return std::min (v.scale_x, v.scale_y) > 1E-5*extent;
+    }
+
+    MANDEL_TARGET_AVX void compute_coarse_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words, std::uint64_t * unsure) const noexcept
+    {
+      auto min_x_4    = _mm256_set1_pd (v.min_x);
+      auto scale_x_4  = _mm256_set1_pd (v.scale_x);
+      auto lshift_x_4 = _mm256_set_pd (4, 5, 6, 7);
+      auto ushift_x_4 = _mm256_set_pd (0, 1, 2, 3);
+
+      // Coordinates are computed in double and rounded once
+      auto cy0 = _mm256_set1_ps (static_cast<float> (v.scale_y*y       + v.min_y));
+      auto cy1 = _mm256_set1_ps (static_cast<float> (v.scale_y*(y + 1) + v.min_y));
+
+      for (auto b = 0U; b < bytes; b += 2)
+      {
+        // Lane 0 is the last pixel of a byte so the mask is the byte
+        __m256 cxs[2];
+        for (auto k = 0U; k < 2U; ++k)
+        {
+          auto x_8  = _mm256_set1_pd ((ww + b + k)*8);
+          auto lo   = _mm256_cvtpd_ps (_mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, lshift_x_4), scale_x_4)));
+          auto hi   = _mm256_cvtpd_ps (_mm256_add_pd (min_x_4, _mm256_mul_pd (_mm256_add_pd (x_8, ushift_x_4), scale_x_4)));
+          cxs[k]    = _mm256_insertf128_ps (_mm256_castps128_ps256 (lo), hi, 1);
+        }
+
+        __m256 cx[4] { cxs[0], cxs[1], cxs[0], cxs[1] };
+        __m256 cy[4] { cy0, cy0, cy1, cy1 };
+
+        std::uint32_t inside[4];
+        std::uint32_t unsures[4];
+        mandelbrot_float (cx, cy, v.max_iter, inside, unsures);
+
+        // A ragged word computes a byte past it, dropped here
+        for (auto k = 0U; k < 2U && b + k < bytes; ++k)
+        {
+          words[0] |= static_cast<std::uint64_t> (inside[k]    ) << 8*(b + k);
+          words[1] |= static_cast<std::uint64_t> (inside[k + 2]) << 8*(b + k);
+          unsure[0] |= static_cast<std::uint64_t> (unsures[k]    ) << 8*(b + k);
+          unsure[1] |= static_cast<std::uint64_t> (unsures[k + 2]) << 8*(b + k);
+        }
+      }
+
+      // Escapes in float are sure only if the block kernel's first steps
+      //  escape too
+      auto mask       = bytes == 8 ? ~std::uint64_t (0) : (std::uint64_t (1) << 8*bytes) - 1;
+      auto escaped0   = ~words[0] & ~unsure[0] & mask;
+      auto escaped1   = ~words[1] & ~unsure[1] & mask;
+      if ((escaped0 | escaped1) != 0)
+      {
+        std::uint64_t alive[2] {};
+        early.compute_word (y, ww, bytes, alive);
+        unsure[0] |= escaped0 & alive[0];
+        unsure[1] |= escaped1 & alive[1];
+      }
+    }
+
+    void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const noexcept
+    {
+      precise.compute_word (y, ww, bytes, words);
+    }
+
+  private:
+    static view first_steps (view v) noexcept
+    {
+      v.max_iter = std::min (v.max_iter, hybrid_late);
+      return v;
+    }
+
+    view        v       ;
+    avx_kernel  precise ;
+    avx_kernel  early   ; // the first hybrid_late steps of precise
+  };
+
+  // Fixed-point kernel
+  //  Coordinates are Q3.28 fixed-point numbers held in the low 32 bits of each
+  //  64-bit lane so _mm256_mul_epi32 yields the exact Q6.56 product. Only
+  //  integer operations are used so the output is bit-identical regardless of
+  //  compiler, floating-point flags or FMA contraction. A pixel with cx or cy
+  //  outside +-2 escapes at once and starts escaped, the others have |c| <
+  //  2.83 and values within +-7 while still inside, in the Q3.28 range. Once
+  //  outside, the values may wrap which is why escapes are tracked with a
+  //  sticky mask.
+  //
+  //  Only this 32-bit path exists. Every step rounds z to 28 fraction bits
+  //  and boundary orbits amplify that, so the bits part from the double
+  //  kernels as pixels shrink, on a 2E-7 pixel step 4% of the pixels
+  //  differ. Views with pixels finer than 2^-14 are rendered by the block
+  //  kernel instead. Deeper zooms would need 64-bit coordinates and an
+  //  emulated 64x64 multiply-high, which AVX2 lacks.
+
+  constexpr auto fixed_bits = 28;
+
+  // The finest pixel step as a power of 2 the fixed kernel renders itself
+  constexpr auto fixed_min_step = -14;
+
+  // v with fixed_bits + shift fraction bits
+  MANDEL_INLINE std::int64_t to_fixed (double v, int shift) noexcept
+  {
+    return static_cast<std::int64_t> (std::ldexp (v, fixed_bits + shift));
+  }
+
+#define MANDEL_FIXED_INDEPENDENT(i)                                                             \
+        xy[i] = _mm256_mul_epi32 (x[i], y[i]);                                                  \
+        x2[i] = _mm256_mul_epi32 (x[i], x[i]);                                                  \
+        y2[i] = _mm256_mul_epi32 (y[i], y[i]);                                                  \
+        esc[i]= _mm256_or_si256 (esc[i], _mm256_cmpgt_epi64 (_mm256_add_epi64 (x2[i], y2[i]), four_q));
+#define MANDEL_FIXED_DEPENDENT(i)                                                               \
+        y[i]  = _mm256_add_epi64 (_mm256_srli_epi64 (xy[i], fixed_bits - 1), cy[i]);            \
+        x[i]  = _mm256_add_epi64 (_mm256_srli_epi64 (_mm256_sub_epi64 (x2[i], y2[i]), fixed_bits), cx[i]);
+
+#define MANDEL_FIXED_ITERATION()  \
+    MANDEL_FIXED_INDEPENDENT(0)   \
+    MANDEL_FIXED_DEPENDENT(0)     \
+    MANDEL_FIXED_INDEPENDENT(1)   \
+    MANDEL_FIXED_DEPENDENT(1)     \
+    MANDEL_FIXED_INDEPENDENT(2)   \
+    MANDEL_FIXED_DEPENDENT(2)     \
+    MANDEL_FIXED_INDEPENDENT(3)   \
+    MANDEL_FIXED_DEPENDENT(3)
+
+#define MANDEL_FIXED_ESCMASK(i) \
+  _mm256_movemask_pd (_mm256_castsi256_pd (esc[i]))
+
+  // Lanes of c outside [-2, 2], they escape at the first step
+  MANDEL_TARGET_AVX2 MANDEL_INLINE __m256i fixed_outside (__m256i c) noexcept
+  {
+    auto two_q = _mm256_set1_epi64x (2LL << fixed_bits);
+    return _mm256_or_si256 (
+        _mm256_cmpgt_epi64 (c, two_q)
+      , _mm256_cmpgt_epi64 (_mm256_sub_epi64 (_mm256_setzero_si256 (), two_q), c)
+      );
+  }
+
+  MANDEL_TARGET_AVX2 MANDEL_INLINE std::uint32_t mandelbrot_fixed (__m256i cx[4], __m256i cy[4], std::uint32_t max_iter)
+  {
+    auto four_q = _mm256_set1_epi64x (4LL << 2*fixed_bits);
+
+    __m256i   x[4] {cx[0], cx[1], cx[2], cx[3]};
+    __m256i   y[4] {cy[0], cy[1], cy[2], cy[3]};
+    __m256i  x2[4];
+    __m256i  y2[4];
+    __m256i  xy[4];
+    __m256i esc[4];
+
+    // c may not fit in the low 32 bits, such lanes must not be tested
+    for (auto i = 0U; i < 4U; ++i)
+    {
+      esc[i] = _mm256_or_si256 (fixed_outside (cx[i]), fixed_outside (cy[i]));
+    }
+
+    // max_iter / 8 * 8 + max_iter % 8 => max_iter iterations
+    for (auto iter = max_iter / 8; iter > 0; --iter)
+    {
+      // 8 inner steps
+      MANDEL_FIXED_ITERATION();
+      MANDEL_FIXED_ITERATION();
+      MANDEL_FIXED_ITERATION();
+      MANDEL_FIXED_ITERATION();
+      MANDEL_FIXED_ITERATION();
+      MANDEL_FIXED_ITERATION();
+      MANDEL_FIXED_ITERATION();
+      MANDEL_FIXED_ITERATION();
+
+      auto all_escaped = _mm256_and_si256 (
+          _mm256_and_si256 (esc[0], esc[1])
+        , _mm256_and_si256 (esc[2], esc[3])
+        );
+      if (_mm256_movemask_pd (_mm256_castsi256_pd (all_escaped)) == 0xF)
+      {
+        return 0;
+      }
+    }
+
+    // Last steps
+    for (auto iter = max_iter % 8; iter > 0; --iter)
+    {
+      MANDEL_FIXED_ITERATION();
+    }
+
+    std::uint32_t esc_mask =
+        (MANDEL_FIXED_ESCMASK (0) << 4 )
+      | (MANDEL_FIXED_ESCMASK (1)      )
+      | (MANDEL_FIXED_ESCMASK (2) << 12)
+      | (MANDEL_FIXED_ESCMASK (3) << 8 )
+      ;
+
+    return ~esc_mask & 0xFFFF;
+  }
+
+  struct fixed_kernel
+  {
+    using kind = mandel::block_kind;
+
+    static constexpr std::size_t rows = 2;
+
+    static char const * name () noexcept
+    {
+      return "fixed";
+    }
+
+    static bool supported () noexcept
+    {
+      return mandel::cpu_supports_avx2 ();
+    }
+
+    // Coordinates are derived with integer arithmetic only. The corner and
+    //  the scales are taken with shift more fraction bits than fixed_bits,
+    //  as many as the view leaves room for, and each coordinate is rounded
+    //  down to fixed_bits. That is floor (c*2^28) of the exact c = min +
+    //  x*scale whenever min and scale fit those bits, as on a snap_view
+    //  grid, so a pan by whole pixels computes the same coordinates.
+    explicit fixed_kernel (view const & v) noexcept
+      : usable    (std::min (v.scale_x, v.scale_y) >= std::ldexp (1.0, fixed_min_step))
+      , precise   (v)
+      , max_iter  (v.max_iter)
+      , shift     (fraction_shift (v))
+      , min_x_q   (to_fixed (v.min_x, shift))
+      , scale_x_q (to_fixed (v.scale_x, shift))
+      , min_y_q   (to_fixed (v.min_y, shift))
+      , scale_y_q (to_fixed (v.scale_y, shift))
+    {
+    }
+
+    MANDEL_TARGET_AVX2 void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const noexcept
+    {
+      if (!usable)
+      {
+        precise.compute_word (y, ww, bytes, words);
+        return;
+      }
+
+      auto sy   = static_cast<std::int64_t> (y);
+      auto cy0  = _mm256_set1_epi64x ((min_y_q + (sy + 0)*scale_y_q) >> shift);
+      auto cy1  = _mm256_set1_epi64x ((min_y_q + (sy + 1)*scale_y_q) >> shift);
+
+      auto cx_q = min_x_q + static_cast<std::int64_t> (ww*8)*scale_x_q;
+      std::int64_t cxs[64];
+      for (auto i = 0U; i < bytes*8; ++i)
+      {
+        cxs[i]  = cx_q >> shift;
+        cx_q   += scale_x_q;
+      }
+
+      for (auto b = 0U; b < bytes; ++b)
+      {
+        auto pcx  = cxs + b*8;
+        auto cx0  = _mm256_set_epi64x (pcx[0], pcx[1], pcx[2], pcx[3]);
+        auto cx1  = _mm256_set_epi64x (pcx[4], pcx[5], pcx[6], pcx[7]);
+        __m256i cx[4] { cx0, cx1, cx0, cx1 };
+        __m256i cy[4] { cy0, cy0, cy1, cy1 };
+        auto bits = mandelbrot_fixed (cx, cy, max_iter);
+
+        words[0] |= static_cast<std::uint64_t> (0xFF & (bits     )) << 8*b;
+        words[1] |= static_cast<std::uint64_t> (0xFF & (bits >> 8)) << 8*b;
+      }
+    }
+
+  private:
+    // The view's corners and the extent from them are below 2^e, so they
+    //  fit 2^62 with 33 - e fraction bits more than fixed_bits
+    static int fraction_shift (view const & v) noexcept
+    {
+      auto m = std::max ({ 1.0, std::abs (v.min_x), std::abs (v.max_x), std::abs (v.min_y), std::abs (v.max_y) });
+      auto e = 0;
+      std::frexp (m, &e);
+      return std::max (0, 33 - e);
+    }
+
+    bool          usable   ;
+    avx_kernel    precise  ;
+    std::uint32_t max_iter ;
+    int           shift    ;
+    std::int64_t  min_x_q  ;
+    std::int64_t  scale_x_q;
+    std::int64_t  min_y_q  ;
+    std::int64_t  scale_y_q;
+  };
+
+  // SSE2 kernel
+  //  Fallback for CPUs without AVX. Same 4 chain interleave as the AVX kernel
+  //  but each chain holds 2 pixels so a call computes 8 pixels of one row.
+
+#define MANDEL_SSE2_INDEPENDENT(i)                                    \
+        xy[i] = _mm_mul_pd (x[i], y[i]);                              \
+        x2[i] = _mm_mul_pd (x[i], x[i]);                              \
+        y2[i] = _mm_mul_pd (y[i], y[i]);
+#define MANDEL_SSE2_DEPENDENT(i)                                      \
+        y[i]  = _mm_add_pd (_mm_add_pd (xy[i], xy[i]) , cy);          \
+        x[i]  = _mm_add_pd (_mm_sub_pd (x2[i], y2[i]) , cx[i]);
+
+#define MANDEL_SSE2_ITERATION() \
+    MANDEL_SSE2_INDEPENDENT(0)  \
+    MANDEL_SSE2_DEPENDENT(0)    \
+    MANDEL_SSE2_INDEPENDENT(1)  \
+    MANDEL_SSE2_DEPENDENT(1)    \
+    MANDEL_SSE2_INDEPENDENT(2)  \
+    MANDEL_SSE2_DEPENDENT(2)    \
+    MANDEL_SSE2_INDEPENDENT(3)  \
+    MANDEL_SSE2_DEPENDENT(3)
+
+#define MANDEL_SSE2_CMP(i) \
+  _mm_cmple_pd (_mm_add_pd (x2[i], y2[i]), _mm_set1_pd (4.0))
+
+  MANDEL_INLINE std::uint32_t mandelbrot_sse2 (__m128d cx[4], __m128d cy, std::uint32_t max_iter)
+  {
+    __m128d  x[4] {cx[0], cx[1], cx[2], cx[3]};
+    __m128d  y[4] {cy, cy, cy, cy};
+    __m128d x2[4] {};
+    __m128d y2[4] {};
+    __m128d xy[4];
+
+    // max_iter / 8 * 8 + max_iter % 8 => max_iter iterations
+    for (auto iter = max_iter / 8; iter > 0; --iter)
+    {
+      // 8 inner steps
+      MANDEL_SSE2_ITERATION();
+      MANDEL_SSE2_ITERATION();
+      MANDEL_SSE2_ITERATION();
+      MANDEL_SSE2_ITERATION();
+      MANDEL_SSE2_ITERATION();
+      MANDEL_SSE2_ITERATION();
+      MANDEL_SSE2_ITERATION();
+      MANDEL_SSE2_ITERATION();
+
+      auto cont = _mm_movemask_pd (_mm_or_pd (
+          _mm_or_pd (MANDEL_SSE2_CMP (0), MANDEL_SSE2_CMP (1))
+        , _mm_or_pd (MANDEL_SSE2_CMP (2), MANDEL_SSE2_CMP (3))
+        ));
+      if (!cont)
+      {
+        return 0;
+      }
+    }
+
+    // Last steps
+    for (auto iter = max_iter % 8; iter > 0; --iter)
+    {
+      MANDEL_SSE2_ITERATION();
+    }
+
+    std::uint32_t cmp_mask =
+        (_mm_movemask_pd (MANDEL_SSE2_CMP (0)) << 6)
+      | (_mm_movemask_pd (MANDEL_SSE2_CMP (1)) << 4)
+      | (_mm_movemask_pd (MANDEL_SSE2_CMP (2)) << 2)
+      | (_mm_movemask_pd (MANDEL_SSE2_CMP (3))     )
+      ;
+
+    return cmp_mask;
+  }
+
+  struct sse2_kernel
+  {
+    using kind = mandel::block_kind;
+
+    static constexpr std::size_t rows = 1;
+
+    static char const * name () noexcept
+    {
+      return "sse2";
+    }
+
+    static bool supported () noexcept
+    {
+      return true;
+    }
+
+    explicit sse2_kernel (view const & v) noexcept
+      : v (v)
+    {
+    }
+
+    void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const noexcept
+    {
+      auto min_x_2    = _mm_set1_pd (v.min_x);
+      auto scale_x_2  = _mm_set1_pd (v.scale_x);
+      auto cy         = _mm_set1_pd (v.scale_y*y + v.min_y);
+
+      for (auto b = 0U; b < bytes; ++b)
+      {
+        auto x_2  = _mm_set1_pd (static_cast<double> ((ww + b)*8));
+        __m128d cx[4]
+        {
+          _mm_add_pd (min_x_2, _mm_mul_pd (_mm_add_pd (x_2, _mm_set_pd (0, 1)), scale_x_2)),
+          _mm_add_pd (min_x_2, _mm_mul_pd (_mm_add_pd (x_2, _mm_set_pd (2, 3)), scale_x_2)),
+          _mm_add_pd (min_x_2, _mm_mul_pd (_mm_add_pd (x_2, _mm_set_pd (4, 5)), scale_x_2)),
+          _mm_add_pd (min_x_2, _mm_mul_pd (_mm_add_pd (x_2, _mm_set_pd (6, 7)), scale_x_2)),
+        };
+        auto bits = mandelbrot_sse2 (cx, cy, v.max_iter);
+
+        words[0] |= static_cast<std::uint64_t> (bits) << 8*b;
+      }
+    }
+
+  private:
+    view v;
+  };
 }
 
+int main (int argc, char const * argv[])
+{
+  return mandel::run<avx_kernel, stream_kernel, fixed_kernel, sse2_kernel, count_kernel, lane_kernel, hybrid_kernel, formula_kernel> ("mandelbrot_avx2", argc, argv);
+}
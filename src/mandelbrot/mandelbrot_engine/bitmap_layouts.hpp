@@ -0,0 +1,418 @@
+// ----------------------------------------------------------------------------------------------
+// Copyright 2017 Mårten Rånge
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------------------------
+
+// The layouts a render is stored in: bitmap, row major with its PBM header
+//  in front of the pixels, and tiled_bitmap, tile after tile in Z-order. Count
+//  kernels store escape counts in tiled_counts, shaded into a greymap.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "bitmap_pool.hpp"
+
+namespace mandel
+{
+  // The pixels of a bitmap are preceded by its PBM header in the same
+  //  allocation, so header and pixels go out in one write like mandelbrot_6.
+  //  The pixels start on a cache line. The allocation comes from and goes
+  //  back to a bitmap_pool.
+  struct bitmap
+  {
+    using uptr = std::unique_ptr<bitmap>;
+
+    // Room for "P4\n<x> <y>\n", the header ends where the pixels start
+    static constexpr std::size_t header_reserve = 64;
+
+    std::size_t const x ;
+    std::size_t const y ;
+    std::size_t const w ;
+    std::size_t const sz;
+
+    bitmap (std::size_t x, std::size_t y, bitmap_pool & pool = shared_bitmap_pool ())
+      : x     (x)
+      , y     (y)
+      , w     ((x + 7) / 8)
+      , sz    (w*y)
+      , hsz   (0)
+      , pool  (&pool)
+      , cap   (0)
+    {
+      a = pool.acquire (header_reserve + sz, cap);
+      if (a)
+      {
+        char header[header_reserve];
+        hsz = static_cast<std::size_t> (std::snprintf (header, sizeof header, "P4\n%zu %zu\n", x, y));
+        std::memcpy (a + header_reserve - hsz, header, hsz);
+      }
+    }
+
+    ~bitmap () noexcept
+    {
+      pool->release (a, cap);
+      a = nullptr;
+    }
+
+    bitmap (bitmap && bm) noexcept
+      : x     (bm.x)
+      , y     (bm.y)
+      , w     (bm.w)
+      , sz    (bm.sz)
+      , hsz   (bm.hsz)
+      , pool  (bm.pool)
+      , cap   (bm.cap)
+      , a     (bm.a)
+    {
+      bm.a = nullptr;
+    }
+
+    bitmap (bitmap const &)             = delete;
+    bitmap& operator= (bitmap const &)  = delete;
+    bitmap& operator= (bitmap &&)       = delete;
+
+    std::uint8_t * bits () noexcept
+    {
+      assert (a);
+      return a + header_reserve;
+    }
+
+    std::uint8_t const * bits () const noexcept
+    {
+      assert (a);
+      return a + header_reserve;
+    }
+
+    // The PBM file, header followed by pixels
+    std::uint8_t const * pbm () const noexcept
+    {
+      assert (a);
+      return a + header_reserve - hsz;
+    }
+
+    std::size_t pbm_size () const noexcept
+    {
+      return hsz + sz;
+    }
+
+  private:
+    std::size_t     hsz ;
+    bitmap_pool *   pool;
+    std::size_t     cap ;
+    std::uint8_t *  a   ;
+  };
+
+  inline bitmap::uptr create_bitmap (std::size_t x, std::size_t y)
+  {
+    return std::make_unique<bitmap> (x, y);
+  }
+
+  // An 8-bit greyscale image with its PGM header in front, laid out like bitmap
+  struct greymap
+  {
+    using uptr = std::unique_ptr<greymap>;
+
+    // Room for "P5\n<x> <y>\n255\n", the header ends where the pixels start
+    static constexpr std::size_t header_reserve = 64;
+
+    std::size_t const x ;
+    std::size_t const y ;
+    std::size_t const sz;
+
+    greymap (std::size_t x, std::size_t y, bitmap_pool & pool = shared_bitmap_pool ())
+      : x     (x)
+      , y     (y)
+      , sz    (x*y)
+      , hsz   (0)
+      , pool  (&pool)
+      , cap   (0)
+    {
+      a = pool.acquire (header_reserve + sz, cap);
+      if (a)
+      {
+        char header[header_reserve];
+        hsz = static_cast<std::size_t> (std::snprintf (header, sizeof header, "P5\n%zu %zu\n255\n", x, y));
+        std::memcpy (a + header_reserve - hsz, header, hsz);
+      }
+    }
+
+    ~greymap () noexcept
+    {
+      pool->release (a, cap);
+      a = nullptr;
+    }
+
+    greymap (greymap const &)             = delete;
+    greymap& operator= (greymap const &)  = delete;
+
+    std::uint8_t * pixels () noexcept
+    {
+      assert (a);
+      return a + header_reserve;
+    }
+
+    // The PGM file, header followed by pixels
+    std::uint8_t const * pgm () const noexcept
+    {
+      assert (a);
+      return a + header_reserve - hsz;
+    }
+
+    std::size_t pgm_size () const noexcept
+    {
+      return hsz + sz;
+    }
+
+  private:
+    std::size_t     hsz ;
+    bitmap_pool *   pool;
+    std::size_t     cap ;
+    std::uint8_t *  a   ;
+  };
+
+  // Escape counts are stored tile after tile, each tile_dim*tile_dim tile row
+  //  major. A tile is 8 KiB so it is still in L1 when the stages fused after
+  //  its compute read it, and post processing can stream whole tiles. Counts
+  //  saturate at max_count.
+  constexpr std::size_t   tile_dim  = 64;
+  constexpr std::uint32_t max_count = 0xFFFF;
+
+  // The pixels of a tile, clipped to the image
+  struct tile
+  {
+    std::size_t x0;
+    std::size_t y0;
+    std::size_t w ;
+    std::size_t h ;
+  };
+
+  struct tiled_counts
+  {
+    using uptr = std::unique_ptr<tiled_counts>;
+
+    std::size_t const x       ;
+    std::size_t const y       ;
+    std::size_t const tiles_x ;
+    std::size_t const tiles_y ;
+
+    tiled_counts (std::size_t x, std::size_t y, bitmap_pool & pool = shared_bitmap_pool ())
+      : x       (x)
+      , y       (y)
+      , tiles_x ((x + tile_dim - 1) / tile_dim)
+      , tiles_y ((y + tile_dim - 1) / tile_dim)
+      , pool    (&pool)
+      , cap     (0)
+    {
+      a = reinterpret_cast<std::uint16_t *> (pool.acquire (tiles ()*tile_dim*tile_dim*sizeof (std::uint16_t), cap));
+    }
+
+    ~tiled_counts () noexcept
+    {
+      pool->release (reinterpret_cast<std::uint8_t *> (a), cap);
+      a = nullptr;
+    }
+
+    tiled_counts (tiled_counts const &)             = delete;
+    tiled_counts& operator= (tiled_counts const &)  = delete;
+
+    std::size_t tiles () const noexcept
+    {
+      return tiles_x*tiles_y;
+    }
+
+    // Tiles are numbered row by row
+    tile tile_at (std::size_t i) const noexcept
+    {
+      auto x0 = (i % tiles_x)*tile_dim;
+      auto y0 = (i / tiles_x)*tile_dim;
+      return tile
+      {
+        x0
+      , y0
+      , std::min (tile_dim, x - x0)
+      , std::min (tile_dim, y - y0)
+      };
+    }
+
+    std::uint16_t * tile_counts (std::size_t i) noexcept
+    {
+      assert (a);
+      return a + i*tile_dim*tile_dim;
+    }
+
+    std::uint16_t const * tile_counts (std::size_t i) const noexcept
+    {
+      assert (a);
+      return a + i*tile_dim*tile_dim;
+    }
+
+    std::uint16_t at (std::size_t px, std::size_t py) const noexcept
+    {
+      auto i = (py / tile_dim)*tiles_x + px / tile_dim;
+      return tile_counts (i)[(py % tile_dim)*tile_dim + px % tile_dim];
+    }
+
+  private:
+    bitmap_pool *   pool;
+    std::size_t     cap ;
+    std::uint16_t * a   ;
+  };
+
+  namespace details
+  {
+    // Interleaves the low 16 bits of v with zeros
+    inline std::uint32_t spread_bits (std::uint32_t v) noexcept
+    {
+      v &= 0xFFFF;
+      v = (v | (v << 8)) & 0x00FF00FF;
+      v = (v | (v << 4)) & 0x0F0F0F0F;
+      v = (v | (v << 2)) & 0x33333333;
+      v = (v | (v << 1)) & 0x55555555;
+      return v;
+    }
+  }
+
+  // A bitmap stored tile after tile instead of row after row. A bitmap row
+  //  of a tile_dim*tile_dim tile is w bytes away from the next so a tile
+  //  spans 64 cache lines shared with its neighbours, here a tile is 512
+  //  contiguous bytes, each tile row one 64-bit word like the words of
+  //  compute_word. Tiles are ranked in Z-order of their tile coordinates so
+  //  the tiles around a tile are mostly near it in memory as well. Pixels of
+  //  the edge tiles past x or y are clear.
+  struct tiled_bitmap
+  {
+    using uptr = std::unique_ptr<tiled_bitmap>;
+
+    static constexpr std::size_t tile_w     = tile_dim / 8;
+    static constexpr std::size_t tile_bytes = tile_w*tile_dim;
+
+    std::size_t const x       ;
+    std::size_t const y       ;
+    std::size_t const w       ; // bytes of a row of the PBM
+    std::size_t const tiles_x ;
+    std::size_t const tiles_y ;
+
+    tiled_bitmap (std::size_t x, std::size_t y, bitmap_pool & pool = shared_bitmap_pool ())
+      : x       (x)
+      , y       (y)
+      , w       ((x + 7) / 8)
+      , tiles_x ((x + tile_dim - 1) / tile_dim)
+      , tiles_y ((y + tile_dim - 1) / tile_dim)
+      , order   (tiles_x*tiles_y)
+      , ranks   (tiles_x*tiles_y)
+      , pool    (&pool)
+      , cap     (0)
+    {
+      a = pool.acquire (tiles ()*tile_bytes, cap);
+
+      // Sorting the Morton codes skips the codes of the tiles outside a
+      //  view that isn't a square of a power of 2 tiles
+      auto key = [this] (std::uint32_t i)
+      {
+        return static_cast<std::uint64_t> (details::spread_bits (static_cast<std::uint32_t> (i % tiles_x)))
+          | (static_cast<std::uint64_t> (details::spread_bits (static_cast<std::uint32_t> (i / tiles_x))) << 1)
+          ;
+      };
+
+      for (auto i = 0U; i < order.size (); ++i)
+      {
+        order[i] = i;
+      }
+      std::sort (order.begin (), order.end (), [&key] (std::uint32_t l, std::uint32_t r) { return key (l) < key (r); });
+
+      for (auto r = 0U; r < order.size (); ++r)
+      {
+        ranks[order[r]] = r;
+      }
+    }
+
+    ~tiled_bitmap () noexcept
+    {
+      pool->release (a, cap);
+      a = nullptr;
+    }
+
+    tiled_bitmap (tiled_bitmap const &)             = delete;
+    tiled_bitmap& operator= (tiled_bitmap const &)  = delete;
+
+    std::size_t tiles () const noexcept
+    {
+      return tiles_x*tiles_y;
+    }
+
+    // The tile stored at rank r, tiles are numbered row by row
+    std::size_t tile_at_rank (std::size_t r) const noexcept
+    {
+      return order[r];
+    }
+
+    std::size_t rank (std::size_t tx, std::size_t ty) const noexcept
+    {
+      return ranks[ty*tiles_x + tx];
+    }
+
+    // The tile_bytes of the tile at rank r, row by row
+    std::uint8_t * tile_bits (std::size_t r) noexcept
+    {
+      assert (a);
+      return a + r*tile_bytes;
+    }
+
+    std::uint8_t const * tile_bits (std::size_t r) const noexcept
+    {
+      assert (a);
+      return a + r*tile_bytes;
+    }
+
+    // The tile at tile coordinates tx, ty
+    std::uint8_t const * tile_bits (std::size_t tx, std::size_t ty) const noexcept
+    {
+      return tile_bits (rank (tx, ty));
+    }
+
+    // Copies the rows of tile row ty into rows, w bytes apart
+    void copy_band (std::size_t ty, std::uint8_t * rows) const noexcept
+    {
+      auto y0     = ty*tile_dim;
+      auto height = std::min (tile_dim, y - y0);
+
+      for (auto tx = 0U; tx < tiles_x; ++tx)
+      {
+        auto tile   = tile_bits (tx, ty);
+        auto b0     = tx*tile_w;
+        auto bytes  = std::min (tile_w, w - b0);
+
+        for (auto r = 0U; r < height; ++r)
+        {
+          std::memcpy (rows + r*w + b0, tile + r*tile_w, bytes);
+        }
+      }
+    }
+
+  private:
+    std::vector<std::uint32_t>  order;
+    std::vector<std::uint32_t>  ranks;
+    bitmap_pool *               pool ;
+    std::size_t                 cap  ;
+    std::uint8_t *              a    ;
+  };
+}
@@ -0,0 +1,209 @@
+// ----------------------------------------------------------------------------------------------
+// Copyright 2017 Mårten Rånge
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------------------------
+
+// Keeps the buffers of released bitmaps for the next bitmap of the same size
+//  class. A reused buffer is already faulted in, repeated renders then skip
+//  the page faults of a fresh allocation.
+//
+//  Size classes are quarter octaves, so a buffer is at most 19% larger than
+//  asked for. Idle buffers are kept up to a cap of bytes, set by --pool for
+//  the shared pool.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <emmintrin.h>
+
+#ifndef _MSVC_LANG
+# include <sys/mman.h>
+#endif
+
+namespace mandel
+{
+  struct pool_stats
+  {
+    std::uint64_t acquires    ; // buffers handed out
+    std::uint64_t hits        ; // handed out from the idle buffers
+    std::uint64_t releases    ; // buffers given back
+    std::uint64_t dropped     ; // given back but freed, the cap was reached
+    std::size_t   idle_bytes  ; // kept for reuse right now
+    std::size_t   peak_bytes  ; // most bytes allocated at once, idle or in use
+  };
+
+  struct bitmap_pool
+  {
+    // Buffers from this size are allocated on 2 MiB boundaries and advised
+    //  to use huge pages, fewer pages means fewer faults
+    static constexpr std::size_t huge_size = 2U << 20;
+
+    explicit bitmap_pool (std::size_t cap_bytes) noexcept
+      : cap             (cap_bytes)
+      , allocated_bytes (0)
+      , counters        ()
+    {
+    }
+
+    ~bitmap_pool () noexcept
+    {
+      for (auto & b : idle)
+      {
+        _mm_free (b.p);
+      }
+    }
+
+    bitmap_pool (bitmap_pool const &)             = delete;
+    bitmap_pool& operator= (bitmap_pool const &)  = delete;
+
+    // Rounds size up to its size class
+    static std::size_t size_class (std::size_t size) noexcept
+    {
+      if (size <= 4096)
+      {
+        return (size + 63) & ~std::size_t (63);
+      }
+
+      auto top = std::size_t (1);
+      while (top <= size / 2)
+      {
+        top *= 2;
+      }
+
+      auto step = top / 4;
+      return (size + step - 1) / step * step;
+    }
+
+    // A buffer of at least size bytes aligned to a cache line, returns null
+    //  if the allocation failed
+    std::uint8_t * acquire (std::size_t size, std::size_t & capacity)
+    {
+      capacity = size_class (size);
+
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+
+        ++counters.acquires;
+
+        // Most recently released first, it is the most likely to be cached
+        for (auto i = idle.size (); i > 0; --i)
+        {
+          if (idle[i - 1].capacity == capacity)
+          {
+            auto p = idle[i - 1].p;
+            idle.erase (idle.begin () + (i - 1));
+            counters.idle_bytes -= capacity;
+            ++counters.hits;
+            return p;
+          }
+        }
+
+        allocated_bytes   += capacity;
+        counters.peak_bytes = std::max (counters.peak_bytes, allocated_bytes);
+      }
+
+      auto p = allocate (capacity);
+
+      if (!p)
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        allocated_bytes -= capacity;
+      }
+
+      return p;
+    }
+
+    void release (std::uint8_t * p, std::size_t capacity) noexcept
+    {
+      if (!p)
+      {
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+
+        ++counters.releases;
+
+        if (counters.idle_bytes + capacity <= cap)
+        {
+          idle.push_back (buffer { p, capacity });
+          counters.idle_bytes += capacity;
+          return;
+        }
+
+        ++counters.dropped;
+        allocated_bytes -= capacity;
+      }
+
+      _mm_free (p);
+    }
+
+    // Buffers idle past the new cap are freed as they are released
+    void set_cap (std::size_t cap_bytes) noexcept
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      cap = cap_bytes;
+    }
+
+    pool_stats stats () const
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      return counters;
+    }
+
+  private:
+    struct buffer
+    {
+      std::uint8_t *  p       ;
+      std::size_t     capacity;
+    };
+
+    static std::uint8_t * allocate (std::size_t capacity) noexcept
+    {
+      auto huge = capacity >= huge_size;
+      auto p    = static_cast<std::uint8_t *> (_mm_malloc (capacity, huge ? huge_size : 64));
+#ifndef _MSVC_LANG
+# ifdef MADV_HUGEPAGE
+      if (p && huge)
+      {
+        madvise (p, capacity, MADV_HUGEPAGE);
+      }
+# endif
+#endif
+      return p;
+    }
+
+    mutable std::mutex    mutex           ;
+    std::size_t           cap             ;
+    std::size_t           allocated_bytes ;
+    pool_stats            counters        ;
+    std::vector<buffer>   idle            ;
+  };
+
+  // The default cap of the shared pool, enough for a double buffered
+  //  32000x32000 batch
+  constexpr std::size_t pool_cap_mb = 512;
+
+  inline bitmap_pool & shared_bitmap_pool ()
+  {
+    static bitmap_pool pool (pool_cap_mb << 20);
+    return pool;
+  }
+}
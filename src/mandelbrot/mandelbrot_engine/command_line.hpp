@@ -0,0 +1,648 @@
+// ----------------------------------------------------------------------------------------------
+// Copyright 2017 Mårten Rånge
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------------------------
+
+// The settings of run: the modes, the arguments each takes in their places,
+//  the named options and environment variables, and their parsing. See run
+//  for what they mean.
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "formula_jit.hpp"
+#include "kernel_drivers.hpp"
+
+namespace mandel
+{
+  // What run was asked to do
+  enum class mode
+  {
+    render  ,
+    compare , // time the schedules instead of rendering
+    batch   , // render the jobs read from a job file
+    query   , // time bulk queries of random points against a scalar loop
+    pan     , // time incremental pans against full renders
+    bandwidth , // time renders of a mostly exterior view against filling the bitmap
+    deepen  , // time deepening a render_session against fresh renders
+    count   , // count the pixels inside and estimate the area of the set
+    buddhabrot, // render the density of the escaping orbits
+  };
+
+  enum class format
+  {
+    pbm, // bitmap of the set
+    pgm, // greyscale thumbnail or escape counts, see run
+  };
+
+  // How a render stores its bitmap
+  enum class bitmap_layout
+  {
+    rows  , // row major, see bitmap
+    tiles , // tile after tile in Z-order, see tiled_bitmap
+  };
+
+  namespace details
+  {
+    // The settings of run, each from its default, the environment, an
+    //  argument in its place or a named option, later ones win
+    enum class setting
+    {
+      view    ,
+      size    ,
+      iter    ,
+      kernel  ,
+      threads ,
+      sched   ,
+      output  ,
+      fmt     ,
+      points  ,
+      jobs    ,
+      levels  ,
+      samples ,
+      how     ,
+      formula ,
+      layout  ,
+      pool    ,
+    };
+
+    struct named_setting
+    {
+      setting       what  ;
+      char const *  option; // --option value or --option=value
+      char const *  env   ; // environment variable
+    };
+
+    constexpr named_setting named_settings[] =
+    {
+      { setting::view     , "view"      , "MANDEL_VIEW"        },
+      { setting::size     , "size"      , "MANDEL_SIZE"        },
+      { setting::iter     , "iter"      , "MANDEL_ITER"        },
+      { setting::kernel   , "kernel"    , "MANDEL_KERNEL"      },
+      { setting::threads  , "threads"   , "MANDEL_THREADS"     },
+      { setting::sched    , "schedule"  , "MANDEL_SCHEDULE"    },
+      { setting::output   , "output"    , "MANDEL_OUTPUT"      },
+      { setting::fmt      , "format"    , "MANDEL_FORMAT"      },
+      { setting::points   , "points"    , "MANDEL_POINTS"      },
+      { setting::jobs     , "jobs"      , "MANDEL_JOBS"        },
+      { setting::levels   , "levels"    , "MANDEL_LEVELS"      },
+      { setting::samples  , "samples"   , "MANDEL_SAMPLES"     },
+      { setting::how      , "sampling"  , "MANDEL_SAMPLING"    },
+      { setting::formula  , "formula"   , "MANDEL_FORMULA"     },
+      { setting::layout   , "layout"    , "MANDEL_LAYOUT"      },
+      { setting::pool     , "pool"      , "MANDEL_POOL_CAP_MB" },
+    };
+
+    inline char const * mode_name (mode what) noexcept
+    {
+      switch (what)
+      {
+      case mode::batch:
+        return "batch";
+      case mode::query:
+        return "query";
+      case mode::pan:
+        return "pan";
+      case mode::bandwidth:
+        return "bandwidth";
+      case mode::deepen:
+        return "deepen";
+      case mode::count:
+        return "count";
+      case mode::buddhabrot:
+        return "buddhabrot";
+      case mode::render:
+      case mode::compare:
+        break;
+      }
+      return "render";
+    }
+
+    inline char const * option_name (setting what) noexcept
+    {
+      for (auto & named : named_settings)
+      {
+        if (named.what == what)
+        {
+          return named.option;
+        }
+      }
+      return "";
+    }
+
+    // Whether a setting means anything in a mode, batch jobs carry their
+    //  own views and outputs
+    inline bool uses (mode what, setting s) noexcept
+    {
+      if (s == setting::samples || s == setting::how)
+      {
+        return what == mode::buddhabrot;
+      }
+
+      // Any mode may render with the formula kernel and into pooled bitmaps
+      if (s == setting::formula || s == setting::pool)
+      {
+        return true;
+      }
+
+      if (s == setting::layout)
+      {
+        return what == mode::render;
+      }
+
+      switch (what)
+      {
+      case mode::batch:
+        return s == setting::kernel || s == setting::threads || s == setting::sched || s == setting::jobs;
+      case mode::query:
+        return s == setting::view || s == setting::iter || s == setting::kernel || s == setting::threads || s == setting::sched || s == setting::points;
+      case mode::pan:
+      case mode::bandwidth:
+      case mode::deepen:
+      case mode::count:
+        return s != setting::output && s != setting::fmt && s != setting::points && s != setting::jobs && s != setting::levels;
+      case mode::buddhabrot:
+        return s != setting::fmt && s != setting::points && s != setting::jobs && s != setting::levels;
+      case mode::render:
+      case mode::compare:
+        break;
+      }
+      return s != setting::points && s != setting::jobs && (what == mode::render || s != setting::levels);
+    }
+
+    // The settings taken by the arguments in their places, see run
+    inline std::vector<setting> positional_settings (mode what)
+    {
+      switch (what)
+      {
+      case mode::batch:
+        return { setting::jobs, setting::kernel, setting::sched };
+      case mode::query:
+        return { setting::points, setting::kernel, setting::sched, setting::iter };
+      case mode::pan:
+      case mode::bandwidth:
+      case mode::deepen:
+      case mode::count:
+        return { setting::size, setting::kernel, setting::sched, setting::iter };
+      case mode::buddhabrot:
+        return { setting::size, setting::kernel, setting::sched, setting::iter, setting::output };
+      case mode::render:
+      case mode::compare:
+        break;
+      }
+      return { setting::size, setting::kernel, setting::iter, setting::sched, setting::output };
+    }
+
+    struct settings
+    {
+      mode          what      ;
+      double        box[4]    ; // min_x min_y max_x max_y
+      std::size_t   x         ;
+      std::size_t   y         ;
+      std::uint32_t iter      ;
+      char const *  kernel    ; // nullptr picks the first supported kernel
+      std::size_t   threads   ; // 0 for one per CPU
+      schedule      sched     ;
+      bool          auto_sched;
+      char const *  output    ;
+      bool          auto_fmt  ; // pgm if output ends in .pgm
+      format        fmt       ;
+      bitmap_layout layout    ;
+      std::size_t   points    ;
+      char const *  jobs      ;
+
+      std::vector<std::uint32_t> levels;
+
+      std::uint64_t samples   ;
+      sampling      how       ;
+      char const *  formula   ;
+      std::size_t   pool_mb   ; // cap of the idle bitmaps kept for reuse
+    };
+
+    inline bool parse_uint (char const * source, char const * value, std::uint64_t max, std::uint64_t & result)
+    {
+      char * end  = nullptr;
+      errno       = 0;
+      auto parsed = std::strtoull (value, &end, 10);
+
+      if (*value < '0' || *value > '9' || *end != 0 || errno == ERANGE || parsed == 0 || parsed > max)
+      {
+        std::fprintf (stderr, "%s: '%s' is not an integer from 1 to %llu\n", source, value, static_cast<unsigned long long> (max));
+        return false;
+      }
+
+      result = parsed;
+      return true;
+    }
+
+    // Parses "min_x,min_y,max_x,max_y"
+    inline bool parse_view (char const * source, char const * value, double box[4])
+    {
+      double parsed[4];
+      auto   p = value;
+
+      for (auto i = 0U; i < 4U; ++i)
+      {
+        char * end  = nullptr;
+        parsed[i]   = std::strtod (p, &end);
+
+        auto sep    = i < 3U ? ',' : '\0';
+        if (end == p || *end != sep || !std::isfinite (parsed[i]))
+        {
+          std::fprintf (stderr, "%s: '%s' is not min_x,min_y,max_x,max_y\n", source, value);
+          return false;
+        }
+
+        p = end + 1;
+      }
+
+      if (!(parsed[0] < parsed[2] && parsed[1] < parsed[3]))
+      {
+        std::fprintf (stderr, "%s: '%s' is empty, min_x must be below max_x and min_y below max_y\n", source, value);
+        return false;
+      }
+
+      std::copy (parsed, parsed + 4, box);
+      return true;
+    }
+
+    // Parses "dim" or "widthxheight", count mode needs no bitmap and takes
+    //  larger sizes
+    inline bool parse_size (char const * source, char const * value, std::uint64_t max_dim, std::size_t & x, std::size_t & y)
+    {
+
+      std::string width (value);
+      std::string height (value);
+
+      auto sep = width.find ('x');
+      if (sep != std::string::npos)
+      {
+        height  = width.substr (sep + 1);
+        width   = width.substr (0, sep);
+      }
+
+      std::uint64_t w;
+      std::uint64_t h;
+      if (!parse_uint (source, width.c_str (), max_dim, w) || !parse_uint (source, height.c_str (), max_dim, h))
+      {
+        return false;
+      }
+
+      if (w % 8 != 0)
+      {
+        std::fprintf (stderr, "%s: the width of '%s' must be a multiple of 8\n", source, value);
+        return false;
+      }
+
+      x = static_cast<std::size_t> (w);
+      y = static_cast<std::size_t> (h);
+      return true;
+    }
+
+    // Parses "limit,limit,..." ascending, at most max_levels of them
+    inline bool parse_levels (char const * source, char const * value, std::vector<std::uint32_t> & levels)
+    {
+      std::vector<std::uint32_t> parsed;
+
+      std::string rest (value);
+      for (;;)
+      {
+        auto sep  = rest.find (',');
+        auto part = rest.substr (0, sep);
+
+        std::uint64_t n;
+        if (!parse_uint (source, part.c_str (), UINT32_MAX, n))
+        {
+          return false;
+        }
+
+        if (!parsed.empty () && n <= parsed.back ())
+        {
+          std::fprintf (stderr, "%s: the limits of '%s' must be ascending\n", source, value);
+          return false;
+        }
+
+        parsed.push_back (static_cast<std::uint32_t> (n));
+
+        if (sep == std::string::npos)
+        {
+          break;
+        }
+
+        rest = rest.substr (sep + 1);
+      }
+
+      if (parsed.size () > max_levels)
+      {
+        std::fprintf (stderr, "%s: '%s' has more than %zu limits\n", source, value, max_levels);
+        return false;
+      }
+
+      levels = parsed;
+      return true;
+    }
+
+    inline bool apply (settings & s, setting what, char const * source, char const * value)
+    {
+      std::uint64_t n;
+
+      switch (what)
+      {
+      case setting::view:
+        return parse_view (source, value, s.box);
+      case setting::size:
+        return parse_size (source, value, s.what == mode::count ? 1U << 24 : 1U << 20, s.x, s.y);
+      case setting::iter:
+        if (!parse_uint (source, value, UINT32_MAX, n))
+        {
+          return false;
+        }
+        s.iter = static_cast<std::uint32_t> (n);
+        return true;
+      case setting::kernel:
+        s.kernel = std::strcmp (value, "auto") == 0 ? nullptr : value;
+        return true;
+      case setting::threads:
+        if (!parse_uint (source, value, 4096, n))
+        {
+          return false;
+        }
+        s.threads = static_cast<std::size_t> (n);
+        return true;
+      case setting::sched:
+        s.auto_sched = false;
+        if (std::strcmp (value, "guided") == 0)
+        {
+          s.sched = schedule::guided;
+        }
+        else if (std::strcmp (value, "cyclic") == 0)
+        {
+          s.sched = schedule::cyclic;
+        }
+        else if (std::strcmp (value, "serial") == 0)
+        {
+          s.sched = schedule::serial;
+        }
+        else if (std::strcmp (value, "auto") == 0)
+        {
+          s.auto_sched = true;
+        }
+        else if (s.what == mode::render && std::strcmp (value, "compare") == 0)
+        {
+          s.what = mode::compare;
+        }
+        else
+        {
+          std::fprintf (
+              stderr
+            , "%s: unknown schedule '%s', expected guided, cyclic, serial%s or auto\n"
+            , source
+            , value
+            , s.what == mode::render || s.what == mode::compare ? ", compare" : ""
+            );
+          return false;
+        }
+        return true;
+      case setting::output:
+        if (*value == 0)
+        {
+          std::fprintf (stderr, "%s: the output path is empty, use - for stdout\n", source);
+          return false;
+        }
+        s.output = value;
+        return true;
+      case setting::fmt:
+        s.auto_fmt = false;
+        if (std::strcmp (value, "pbm") == 0)
+        {
+          s.fmt = format::pbm;
+        }
+        else if (std::strcmp (value, "pgm") == 0)
+        {
+          s.fmt = format::pgm;
+        }
+        else
+        {
+          std::fprintf (stderr, "%s: unknown format '%s', expected pbm or pgm\n", source, value);
+          return false;
+        }
+        return true;
+      case setting::points:
+        if (!parse_uint (source, value, SIZE_MAX, n))
+        {
+          return false;
+        }
+        s.points = static_cast<std::size_t> (n);
+        return true;
+      case setting::jobs:
+        s.jobs = value;
+        return true;
+      case setting::levels:
+        return parse_levels (source, value, s.levels);
+      case setting::samples:
+        return parse_uint (source, value, UINT64_MAX, s.samples);
+      case setting::how:
+        if (std::strcmp (value, "uniform") == 0)
+        {
+          s.how = sampling::uniform;
+        }
+        else if (std::strcmp (value, "importance") == 0)
+        {
+          s.how = sampling::importance;
+        }
+        else
+        {
+          std::fprintf (stderr, "%s: unknown sampling '%s', expected uniform or importance\n", source, value);
+          return false;
+        }
+        return true;
+      case setting::formula:
+        {
+          formula_code code;
+          std::string error;
+          if (!compile_formula (value, code, error))
+          {
+            std::fprintf (stderr, "%s: '%s' isn't a formula, %s\n", source, value, error.c_str ());
+            return false;
+          }
+          s.formula = value;
+          return true;
+        }
+      case setting::layout:
+        if (std::strcmp (value, "rows") == 0)
+        {
+          s.layout = bitmap_layout::rows;
+        }
+        else if (std::strcmp (value, "tiles") == 0)
+        {
+          s.layout = bitmap_layout::tiles;
+        }
+        else
+        {
+          std::fprintf (stderr, "%s: unknown layout '%s', expected rows or tiles\n", source, value);
+          return false;
+        }
+        return true;
+      case setting::pool:
+        if (!parse_uint (source, value, SIZE_MAX >> 20, n))
+        {
+          return false;
+        }
+        s.pool_mb = static_cast<std::size_t> (n);
+        return true;
+      }
+
+      return false;
+    }
+
+    inline void print_usage (std::FILE * out, char const * program)
+    {
+      std::fprintf (
+          out
+        , "Usage: %s [dim] [kernel|auto] [max_iter] [guided|cyclic|serial|compare|auto] [output|-] [options]\n"
+          "       %s batch [jobs|-] [kernel|auto] [guided|cyclic|serial|auto] [options]\n"
+          "       %s query [points] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]\n"
+          "       %s pan [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]\n"
+          "       %s bandwidth [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]\n"
+          "       %s deepen [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]\n"
+          "       %s count [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]\n"
+          "       %s buddhabrot [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [output|-] [options]\n"
+          "Options, also read from the environment variable in brackets:\n"
+          "  --view min_x,min_y,max_x,max_y  complex plane rendered (MANDEL_VIEW)\n"
+          "  --size dim|widthxheight         pixels, the width a multiple of 8 (MANDEL_SIZE)\n"
+          "  --iter n                        max_iter (MANDEL_ITER)\n"
+          "  --kernel name|auto              (MANDEL_KERNEL)\n"
+          "  --threads n                     threads of the guided and cyclic schedules (MANDEL_THREADS)\n"
+          "  --schedule name                 (MANDEL_SCHEDULE)\n"
+          "  --output path|-                 - writes to stdout (MANDEL_OUTPUT)\n"
+          "  --format pbm|pgm                pgm if the output ends in .pgm (MANDEL_FORMAT)\n"
+          "  --points n                      query points (MANDEL_POINTS)\n"
+          "  --jobs path|-                   batch job file (MANDEL_JOBS)\n"
+          "  --levels limit,limit,...        one bitmap per ascending max_iter, see run (MANDEL_LEVELS)\n"
+          "  --samples n                     buddhabrot points (MANDEL_SAMPLES)\n"
+          "  --sampling uniform|importance   importance is biased, see compute_density (MANDEL_SAMPLING)\n"
+          "  --formula expr                  next z of the formula kernel, see formula_jit.hpp (MANDEL_FORMULA)\n"
+          "  --layout rows|tiles             bitmap layout of a render, see run (MANDEL_LAYOUT)\n"
+          "  --pool mb                       idle bitmaps kept for reuse, see bitmap_pool.hpp (MANDEL_POOL_CAP_MB)\n"
+          "  --help\n"
+        , program
+        , program
+        , program
+        , program
+        , program
+        , program
+        , program
+        , program
+        );
+    }
+
+    // Fills s from the environment and argv, false with the reason on
+    //  stderr if any of them is invalid
+    inline bool parse_settings (char const * program, int argc, char const * argv[], settings & s)
+    {
+      auto first = s.what == mode::render ? 1 : 2;
+
+      for (auto & named : named_settings)
+      {
+        auto value = std::getenv (named.env);
+        if (value && *value && uses (s.what, named.what) && !apply (s, named.what, named.env, value))
+        {
+          return false;
+        }
+      }
+
+      auto places = positional_settings (s.what);
+      auto place  = std::size_t (0);
+
+      for (auto i = first; i < argc; ++i)
+      {
+        auto arg = argv[i];
+
+        if (std::strncmp (arg, "--", 2) != 0)
+        {
+          if (place >= places.size ())
+          {
+            std::fprintf (stderr, "Unexpected argument '%s', see %s --help\n", arg, program);
+            return false;
+          }
+
+          char source[64];
+          std::snprintf (source, sizeof source, "argument %d (--%s)", i, option_name (places[place]));
+
+          if (!apply (s, places[place++], source, arg))
+          {
+            return false;
+          }
+          continue;
+        }
+
+        auto name   = std::string (arg + 2);
+        auto eq     = name.find ('=');
+        auto value  = eq != std::string::npos ? arg + 2 + eq + 1 : nullptr;
+        name        = name.substr (0, eq);
+
+        auto found = std::find_if (
+            std::begin (named_settings)
+          , std::end (named_settings)
+          , [&name] (named_setting const & n) { return name == n.option; }
+          );
+
+        if (found == std::end (named_settings))
+        {
+          std::fprintf (stderr, "Unknown option %s, see %s --help\n", arg, program);
+          return false;
+        }
+
+        if (!uses (s.what, found->what))
+        {
+          std::fprintf (stderr, "Option --%s isn't used in %s mode\n", found->option, mode_name (s.what));
+          return false;
+        }
+
+        if (!value)
+        {
+          if (i + 1 >= argc)
+          {
+            std::fprintf (stderr, "Option --%s needs a value\n", found->option);
+            return false;
+          }
+          value = argv[++i];
+        }
+
+        if (!apply (s, found->what, arg, value))
+        {
+          return false;
+        }
+      }
+
+      if (s.auto_fmt)
+      {
+        auto n  = s.output ? std::strlen (s.output) : 0;
+        s.fmt   = n >= 4 && std::strcmp (s.output + n - 4, ".pgm") == 0 ? format::pgm : format::pbm;
+      }
+
+      return true;
+    }
+  }
+}
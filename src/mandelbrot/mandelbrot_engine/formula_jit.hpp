@@ -0,0 +1,942 @@
+// ----------------------------------------------------------------------------------------------
+// Copyright 2017 Mårten Rånge
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------------------------
+
+// Iteration formulas compiled at runtime into AVX machine code. A formula is
+//  an expression of z and c giving the next z of the orbit:
+//
+//    expr    := term { (+|-) term }
+//    term    := unary { * unary }
+//    unary   := - unary | power
+//    power   := primary [ ^ n ]          n from 1 to 8
+//    primary := z | c | number [i] | i | conj (expr) | fabs (expr) | (expr)
+//
+//  conj negates the imaginary part, fabs makes both parts positive so
+//  "fabs (z)^2 + c" is the burning ship. Numbers are real unless followed by
+//  i.
+//
+//  compile_formula emits x86-64 code iterating 16 points as 4 chains of 4
+//  lanes the way MANDEL_ITERATION does: a step evaluates the formula for
+//  chain 0 to 3 in turn and every 8 steps the code returns early if all
+//  points have escaped. Chain k's z stays in ymm2k and ymm2k+1, the formula
+//  evaluates in 4 slots of a complex value each in ymm8 to ymm15, c and the
+//  constants are memory operands. formula_program maps the code into pages
+//  that are made executable once written, only the System V x86-64 calling
+//  convention is emitted.
+
+#pragma once
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined (__x86_64__) && !defined (_MSVC_LANG) && !defined (_WIN32)
+# include <sys/mman.h>
+# define MANDEL_FORMULA_JIT
+#endif
+
+namespace mandel
+{
+  // The formula of the classic set
+  constexpr char const default_formula[] = "z^2 + c";
+
+  // Powers are unrolled into squares and products up to this exponent
+  constexpr unsigned formula_max_power = 8;
+
+  // Parentheses, calls and negations nest at most this deep, the parser and
+  //  the compiler recurse once per level
+  constexpr unsigned formula_max_depth = 256;
+
+  // The code compiled from a formula
+  //    std::uint32_t f (double const * c, double const * constants, std::uint32_t blocks, std::uint32_t rest);
+  //  steps the orbits starting at z = c 8*blocks + rest times. c holds chain
+  //  k's real parts at c[8k] and imaginary parts at c[8k + 4]. Bit 4k + l of
+  //  the result is set if lane l of chain k hasn't escaped.
+  struct formula_code
+  {
+    std::vector<std::uint8_t> code      ;
+    std::vector<double>       constants ; // 4 copies of each, one ymm load apart
+  };
+
+  namespace details
+  {
+    enum class formula_op
+    {
+      z       ,
+      c       ,
+      constant,
+      add     ,
+      sub     ,
+      mul     ,
+      neg     ,
+      square  ,
+      power   ,
+      conj    ,
+      fabs    ,
+    };
+
+    struct formula_node
+    {
+      formula_op  op  ;
+      int         a   ; // operand nodes, -1 if none
+      int         b   ;
+      unsigned    n   ; // power, or the real part's constant of a constant
+    };
+
+    // The constants every formula uses, then the formula's own
+    constexpr unsigned formula_four = 0;
+    constexpr unsigned formula_sign = 1;
+    constexpr unsigned formula_abs  = 2;
+
+    struct formula_parser
+    {
+      explicit formula_parser (char const * text)
+        : text      (text)
+        , at        (text)
+        , nodes     (nullptr)
+        , constants (nullptr)
+        , depth     (0)
+      {
+      }
+
+      // The root node, -1 with error set if the text isn't a formula
+      int parse (std::vector<formula_node> & result, std::vector<double> & values)
+      {
+        nodes     = &result;
+        constants = &values;
+
+        auto root = expr ();
+        skip ();
+        if (root >= 0 && *at != 0)
+        {
+          return fail ("unexpected character");
+        }
+
+        return root;
+      }
+
+      std::string error;
+
+    private:
+      char const *                text      ;
+      char const *                at        ;
+      std::vector<formula_node> * nodes     ;
+      std::vector<double> *       constants ;
+      unsigned                    depth     ;
+
+      int fail (char const * why)
+      {
+        if (error.empty ())
+        {
+          error = std::string (why) + " at column " + std::to_string (at - text + 1);
+        }
+        return -1;
+      }
+
+      int node (formula_op op, int a = -1, int b = -1, unsigned n = 0)
+      {
+        nodes->push_back (formula_node { op, a, b, n });
+        return static_cast<int> (nodes->size () - 1);
+      }
+
+      void skip () noexcept
+      {
+        while (std::isspace (static_cast<unsigned char> (*at)))
+        {
+          ++at;
+        }
+      }
+
+      bool accept (char ch) noexcept
+      {
+        skip ();
+        if (*at != ch)
+        {
+          return false;
+        }
+        ++at;
+        return true;
+      }
+
+      bool word (char const * w) noexcept
+      {
+        skip ();
+        auto n = std::strlen (w);
+        if (std::strncmp (at, w, n) != 0 || std::isalnum (static_cast<unsigned char> (at[n])))
+        {
+          return false;
+        }
+        at += n;
+        return true;
+      }
+
+      int constant (double re, double im)
+      {
+        auto first = static_cast<unsigned> (constants->size () / 4);
+        for (auto v : { re, im })
+        {
+          constants->insert (constants->end (), 4, v);
+        }
+        return node (formula_op::constant, -1, -1, first);
+      }
+
+      int expr ()
+      {
+        auto left = term ();
+        while (left >= 0)
+        {
+          if (accept ('+'))
+          {
+            auto right  = term ();
+            left        = right < 0 ? -1 : node (formula_op::add, left, right);
+          }
+          else if (accept ('-'))
+          {
+            auto right  = term ();
+            left        = right < 0 ? -1 : node (formula_op::sub, left, right);
+          }
+          else
+          {
+            break;
+          }
+        }
+        return left;
+      }
+
+      int term ()
+      {
+        auto left = unary ();
+        while (left >= 0 && accept ('*'))
+        {
+          auto right  = unary ();
+          auto & n    = *nodes;
+          // z*z squares as cheaply as z^2
+          left        =
+              right < 0 ? -1
+            : n[left].op == formula_op::z && n[right].op == formula_op::z ? node (formula_op::square, left)
+            : node (formula_op::mul, left, right)
+            ;
+        }
+        return left;
+      }
+
+      // Every nesting passes through here
+      int unary ()
+      {
+        if (depth >= formula_max_depth)
+        {
+          return fail ("nested too deep");
+        }
+
+        ++depth;
+        auto result = negation ();
+        --depth;
+        return result;
+      }
+
+      int negation ()
+      {
+        if (accept ('-'))
+        {
+          auto a = unary ();
+          return a < 0 ? -1 : node (formula_op::neg, a);
+        }
+        return power ();
+      }
+
+      int power ()
+      {
+        auto base = primary ();
+        if (base < 0 || !accept ('^'))
+        {
+          return base;
+        }
+
+        skip ();
+        char * end  = nullptr;
+        auto n      = std::strtoul (at, &end, 10);
+        if (end == at || n < 1 || n > formula_max_power)
+        {
+          return fail ("expected a power from 1 to 8");
+        }
+        at = end;
+
+        return
+            n == 1 ? base
+          : n == 2 ? node (formula_op::square, base)
+          : node (formula_op::power, base, -1, static_cast<unsigned> (n))
+          ;
+      }
+
+      int call (formula_op op)
+      {
+        if (!accept ('('))
+        {
+          return fail ("expected (");
+        }
+        auto a = expr ();
+        if (a >= 0 && !accept (')'))
+        {
+          return fail ("expected )");
+        }
+        return a < 0 ? -1 : node (op, a);
+      }
+
+      int primary ()
+      {
+        skip ();
+
+        if (accept ('('))
+        {
+          auto a = expr ();
+          if (a >= 0 && !accept (')'))
+          {
+            return fail ("expected )");
+          }
+          return a;
+        }
+
+        if (word ("z"))
+        {
+          return node (formula_op::z);
+        }
+        if (word ("c"))
+        {
+          return node (formula_op::c);
+        }
+        if (word ("i"))
+        {
+          return constant (0.0, 1.0);
+        }
+        if (word ("conj"))
+        {
+          return call (formula_op::conj);
+        }
+        if (word ("fabs"))
+        {
+          return call (formula_op::fabs);
+        }
+
+        if (std::isdigit (static_cast<unsigned char> (*at)) || *at == '.')
+        {
+          char * end  = nullptr;
+          auto v      = std::strtod (at, &end);
+          if (end == at)
+          {
+            return fail ("expected a number");
+          }
+          at = end;
+
+          if (*at == 'i' && !std::isalnum (static_cast<unsigned char> (at[1])))
+          {
+            ++at;
+            return constant (0.0, v);
+          }
+          return constant (v, 0.0);
+        }
+
+        return fail (*at == 0 ? "unexpected end" : "expected z, c, a number, conj, fabs or (");
+      }
+    };
+
+    // Register numbers of the encoding
+    constexpr unsigned reg_rax = 0;
+    constexpr unsigned reg_rdx = 2;
+    constexpr unsigned reg_rsi = 6;
+    constexpr unsigned reg_rdi = 7;
+
+    // A ymm register or [base + disp]
+    struct ymm_operand
+    {
+      bool          mem ;
+      unsigned      reg ;
+      std::int32_t  disp;
+    };
+
+    inline ymm_operand ymm (unsigned reg) noexcept
+    {
+      return ymm_operand { false, reg, 0 };
+    }
+
+    inline ymm_operand memory (unsigned base, std::int32_t disp) noexcept
+    {
+      return ymm_operand { true, base, disp };
+    }
+
+    struct x64_emitter
+    {
+      std::vector<std::uint8_t> code;
+
+      void bytes (std::initializer_list<unsigned> bs)
+      {
+        for (auto b : bs)
+        {
+          code.push_back (static_cast<std::uint8_t> (b));
+        }
+      }
+
+      void dword (std::uint32_t d)
+      {
+        bytes ({ d & 0xFF, (d >> 8) & 0xFF, (d >> 16) & 0xFF, d >> 24 });
+      }
+
+      // VEX.256.66.0F op dst, src, rm. src is 0 for the ops without one,
+      //  bases are rsi or rdi so a memory operand needs no SIB byte.
+      void vex (unsigned op, unsigned dst, unsigned src, ymm_operand rm)
+      {
+        auto r = (dst >> 3) & 1;
+        auto b = (rm.reg >> 3) & 1;
+        bytes ({ 0xC4, (r ^ 1) << 7 | 1 << 6 | (b ^ 1) << 5 | 0x01, (~src & 0xF) << 3 | 1 << 2 | 0x01, op });
+        if (rm.mem)
+        {
+          bytes ({ 0x80 | (dst & 7) << 3 | (rm.reg & 7) });
+          dword (static_cast<std::uint32_t> (rm.disp));
+        }
+        else
+        {
+          bytes ({ 0xC0 | (dst & 7) << 3 | (rm.reg & 7) });
+        }
+      }
+
+      void vmov (unsigned dst, ymm_operand rm)
+      {
+        vex (rm.mem ? 0x10 : 0x28, dst, 0, rm);    // vmovupd or vmovapd
+      }
+
+      void vadd (unsigned dst, unsigned src, ymm_operand rm) { vex (0x58, dst, src, rm); }
+      void vmul (unsigned dst, unsigned src, ymm_operand rm) { vex (0x59, dst, src, rm); }
+      void vsub (unsigned dst, unsigned src, ymm_operand rm) { vex (0x5C, dst, src, rm); }
+      void vand (unsigned dst, unsigned src, ymm_operand rm) { vex (0x54, dst, src, rm); }
+      void vor  (unsigned dst, unsigned src, ymm_operand rm) { vex (0x56, dst, src, rm); }
+      void vxor (unsigned dst, unsigned src, ymm_operand rm) { vex (0x57, dst, src, rm); }
+
+      // dst = src <= rm
+      void vcmple (unsigned dst, unsigned src, ymm_operand rm)
+      {
+        vex (0xC2, dst, src, rm);
+        bytes ({ 0x12 });   // _CMP_LE_OQ
+      }
+
+      void vmovmsk (unsigned gpr, unsigned src)
+      {
+        vex (0x50, gpr, 0, ymm (src));
+      }
+
+      // A forward jump, 0x84 jz or 0x85 jnz, land patches it
+      std::size_t jump (unsigned cc)
+      {
+        bytes ({ 0x0F, cc });
+        dword (0);
+        return code.size () - 4;
+      }
+
+      void land (std::size_t at)
+      {
+        auto rel = static_cast<std::uint32_t> (code.size () - (at + 4));
+        for (auto i = 0U; i < 4; ++i)
+        {
+          code[at + i] = static_cast<std::uint8_t> (rel >> 8*i);
+        }
+      }
+
+      void jump_back (unsigned cc, std::size_t target)
+      {
+        bytes ({ 0x0F, cc });
+        dword (static_cast<std::uint32_t> (static_cast<std::int64_t> (target) - static_cast<std::int64_t> (code.size () + 4)));
+      }
+    };
+
+    // Evaluates the formula for one chain at a time
+    struct formula_compiler
+    {
+      static constexpr unsigned slots = 4;
+
+      formula_compiler (std::vector<formula_node> const & nodes, x64_emitter & e)
+        : nodes (nodes)
+        , e     (e)
+        , chain (0)
+      {
+      }
+
+      std::vector<formula_node> const & nodes ;
+      x64_emitter &                     e     ;
+      unsigned                          chain ;
+      std::string                       error ;
+
+      static unsigned re (unsigned s) noexcept { return 8 + 2*s; }
+      static unsigned im (unsigned s) noexcept { return 9 + 2*s; }
+
+      unsigned z_re () const noexcept { return 2*chain; }
+      unsigned z_im () const noexcept { return 2*chain + 1; }
+
+      static ymm_operand constant (unsigned k) noexcept
+      {
+        return memory (reg_rsi, static_cast<std::int32_t> (32*k));
+      }
+
+      bool leaf (int n) const noexcept
+      {
+        auto op = nodes[n].op;
+        return op == formula_op::z || op == formula_op::c || op == formula_op::constant;
+      }
+
+      ymm_operand leaf_re (int n) const noexcept
+      {
+        auto & node = nodes[n];
+        return
+            node.op == formula_op::z  ? ymm (z_re ())
+          : node.op == formula_op::c  ? memory (reg_rdi, static_cast<std::int32_t> (64*chain))
+          : constant (node.n)
+          ;
+      }
+
+      ymm_operand leaf_im (int n) const noexcept
+      {
+        auto & node = nodes[n];
+        return
+            node.op == formula_op::z  ? ymm (z_im ())
+          : node.op == formula_op::c  ? memory (reg_rdi, static_cast<std::int32_t> (64*chain + 32))
+          : constant (node.n + 1)
+          ;
+      }
+
+      bool room (unsigned s)
+      {
+        if (s >= slots && error.empty ())
+        {
+          error = "the formula needs too many registers, simplify it";
+        }
+        return s < slots;
+      }
+
+      // Slot s times the operand in br, bi, t is scratch
+      void multiply (unsigned s, ymm_operand br, ymm_operand bi, unsigned t)
+      {
+        e.vmul (re (t), re (s), br);
+        e.vmul (im (t), im (s), bi);
+        e.vsub (re (t), re (t), ymm (im (t)));
+        e.vmul (im (t), re (s), bi);
+        e.vmul (re (s), im (s), br);
+        e.vadd (im (s), im (t), ymm (re (s)));
+        e.vmov (re (s), ymm (re (t)));
+      }
+
+      // Squares ar, ai into slot s, in place if they are slot s
+      bool square (unsigned s, unsigned ar, unsigned ai)
+      {
+        auto in_place = ar == re (s);
+        auto t        = in_place ? s + 1 : s;
+        if (!room (t))
+        {
+          return false;
+        }
+
+        e.vmul (re (t), ar, ymm (ar));
+        e.vmul (im (t), ai, ymm (ai));
+        e.vsub (re (t), re (t), ymm (im (t)));
+        e.vmul (im (s), ar, ymm (ai));
+        e.vadd (im (s), im (s), ymm (im (s)));
+        if (in_place)
+        {
+          e.vmov (re (s), ymm (re (t)));
+        }
+        return true;
+      }
+
+      // Raises slot s to n by squares and products
+      bool power (unsigned s, unsigned n)
+      {
+        if (n == 1)
+        {
+          return true;
+        }
+
+        if (n % 2 == 0)
+        {
+          return power (s, n / 2) && square (s, re (s), im (s));
+        }
+
+        if (!room (s + 2))
+        {
+          return false;
+        }
+
+        e.vmov (re (s + 1), ymm (re (s)));
+        e.vmov (im (s + 1), ymm (im (s)));
+        if (!power (s + 1, n - 1))
+        {
+          return false;
+        }
+        multiply (s, ymm (re (s + 1)), ymm (im (s + 1)), s + 2);
+        return true;
+      }
+
+      // Evaluates node n into slot s, slots above s are scratch
+      bool eval (int n, unsigned s)
+      {
+        if (!room (s))
+        {
+          return false;
+        }
+
+        auto & node = nodes[n];
+        switch (node.op)
+        {
+        case formula_op::z:
+        case formula_op::c:
+        case formula_op::constant:
+          e.vmov (re (s), leaf_re (n));
+          e.vmov (im (s), leaf_im (n));
+          return true;
+
+        case formula_op::add:
+        case formula_op::sub:
+        case formula_op::mul:
+          {
+            // A leaf is used where it is, the sum and product commute so
+            //  the leaf goes right
+            auto a = node.a;
+            auto b = node.b;
+            if (node.op != formula_op::sub && leaf (a) && !leaf (b))
+            {
+              std::swap (a, b);
+            }
+
+            if (!eval (a, s))
+            {
+              return false;
+            }
+
+            auto br = leaf_re (b);
+            auto bi = leaf_im (b);
+            if (!leaf (b))
+            {
+              if (!eval (b, s + 1))
+              {
+                return false;
+              }
+              br = ymm (re (s + 1));
+              bi = ymm (im (s + 1));
+            }
+
+            if (node.op == formula_op::mul)
+            {
+              auto t = leaf (b) ? s + 1 : s + 2;
+              if (!room (t))
+              {
+                return false;
+              }
+              multiply (s, br, bi, t);
+            }
+            else if (node.op == formula_op::add)
+            {
+              e.vadd (re (s), re (s), br);
+              e.vadd (im (s), im (s), bi);
+            }
+            else
+            {
+              e.vsub (re (s), re (s), br);
+              e.vsub (im (s), im (s), bi);
+            }
+            return true;
+          }
+
+        case formula_op::square:
+          // z squares straight from its registers
+          if (nodes[node.a].op == formula_op::z)
+          {
+            return square (s, z_re (), z_im ());
+          }
+          return eval (node.a, s) && square (s, re (s), im (s));
+
+        case formula_op::power:
+          return eval (node.a, s) && power (s, node.n);
+
+        case formula_op::neg:
+          if (!eval (node.a, s))
+          {
+            return false;
+          }
+          e.vxor (re (s), re (s), constant (formula_sign));
+          e.vxor (im (s), im (s), constant (formula_sign));
+          return true;
+
+        case formula_op::conj:
+          if (!eval (node.a, s))
+          {
+            return false;
+          }
+          e.vxor (im (s), im (s), constant (formula_sign));
+          return true;
+
+        case formula_op::fabs:
+          if (!eval (node.a, s))
+          {
+            return false;
+          }
+          e.vand (re (s), re (s), constant (formula_abs));
+          e.vand (im (s), im (s), constant (formula_abs));
+          return true;
+        }
+
+        return false;
+      }
+
+      // One step of every chain
+      bool step (int root)
+      {
+        for (chain = 0; chain < 4; ++chain)
+        {
+          if (!eval (root, 0))
+          {
+            return false;
+          }
+          e.vmov (z_re (), ymm (re (0)));
+          e.vmov (z_im (), ymm (im (0)));
+        }
+        return true;
+      }
+
+      // ymm8 = the lanes of chain k with |z|^2 <= 4
+      void inside (unsigned k)
+      {
+        e.vmul (8, 2*k    , ymm (2*k    ));
+        e.vmul (9, 2*k + 1, ymm (2*k + 1));
+        e.vadd (8, 8      , ymm (9      ));
+        e.vcmple (8, 8, constant (formula_four));
+      }
+    };
+  }
+
+  // Compiles text into code, false with the reason in error if it isn't a
+  //  formula
+  inline bool compile_formula (char const * text, formula_code & result, std::string & error)
+  {
+    std::vector<details::formula_node> nodes;
+
+    double bits[2];
+    auto sign = 0x8000000000000000ULL;
+    auto abs  = 0x7FFFFFFFFFFFFFFFULL;
+    std::memcpy (bits    , &sign, sizeof sign);
+    std::memcpy (bits + 1, &abs , sizeof abs);
+
+    std::vector<double> constants;
+    constants.insert (constants.end (), 4, 4.0);
+    constants.insert (constants.end (), 4, bits[0]);
+    constants.insert (constants.end (), 4, bits[1]);
+
+    details::formula_parser parser (text);
+    auto root = parser.parse (nodes, constants);
+    if (root < 0)
+    {
+      error = parser.error;
+      return false;
+    }
+
+    details::x64_emitter e;
+    details::formula_compiler compiler (nodes, e);
+    using details::ymm;
+    using details::memory;
+
+    // System V: rdi c, rsi constants, edx blocks, ecx rest
+    for (auto k = 0U; k < 4; ++k)
+    {
+      e.vmov (2*k    , memory (details::reg_rdi, static_cast<std::int32_t> (64*k)));
+      e.vmov (2*k + 1, memory (details::reg_rdi, static_cast<std::int32_t> (64*k + 32)));
+    }
+
+    e.bytes ({ 0x85, 0xD2 });                 // test edx, edx
+    auto no_blocks  = e.jump (0x84);
+    auto block      = e.code.size ();
+
+    for (auto s = 0U; s < 8; ++s)
+    {
+      if (!compiler.step (root))
+      {
+        error = compiler.error;
+        return false;
+      }
+    }
+
+    // Leaves once every lane has escaped
+    for (auto k = 0U; k < 4; ++k)
+    {
+      compiler.inside (k);
+      if (k == 0)
+      {
+        e.vmov (10, ymm (8));
+      }
+      else
+      {
+        e.vor (10, 10, ymm (8));
+      }
+    }
+    e.vmovmsk (details::reg_rax, 10);
+    e.bytes ({ 0x85, 0xC0 });                 // test eax, eax
+    auto escaped = e.jump (0x84);
+
+    e.bytes ({ 0xFF, 0xCA });                 // dec edx
+    e.jump_back (0x85, block);
+
+    e.land (no_blocks);
+    e.bytes ({ 0x85, 0xC9 });                 // test ecx, ecx
+    auto no_rest  = e.jump (0x84);
+    auto rest     = e.code.size ();
+
+    if (!compiler.step (root))
+    {
+      error = compiler.error;
+      return false;
+    }
+
+    e.bytes ({ 0xFF, 0xC9 });                 // dec ecx
+    e.jump_back (0x85, rest);
+
+    e.land (no_rest);
+    e.bytes ({ 0x31, 0xC0 });                 // xor eax, eax
+    for (auto k = 0U; k < 4; ++k)
+    {
+      compiler.inside (k);
+      e.vmovmsk (details::reg_rdx, 8);
+      if (k > 0)
+      {
+        e.bytes ({ 0xC1, 0xE2, 4*k });        // shl edx, 4k
+      }
+      e.bytes ({ 0x09, 0xD0 });               // or eax, edx
+    }
+    e.bytes ({ 0xC5, 0xF8, 0x77, 0xC3 });     // vzeroupper, ret
+
+    e.land (escaped);
+    e.bytes ({ 0x31, 0xC0 });                 // xor eax, eax
+    e.bytes ({ 0xC5, 0xF8, 0x77, 0xC3 });     // vzeroupper, ret
+
+    result.code       = std::move (e.code);
+    result.constants  = std::move (constants);
+    return true;
+  }
+
+  // Whether compiled formulas can run in this process
+  constexpr bool formula_jit_supported () noexcept
+  {
+#ifdef MANDEL_FORMULA_JIT
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // A compiled formula in executable memory
+  struct formula_program
+  {
+    using uptr      = std::unique_ptr<formula_program>;
+    using function  = std::uint32_t (*) (double const *, double const *, std::uint32_t, std::uint32_t);
+
+    // Null if the code can't be mapped
+    static uptr create (formula_code const & code)
+    {
+#ifdef MANDEL_FORMULA_JIT
+      auto size = code.code.size ();
+      auto p    = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+      {
+        return nullptr;
+      }
+
+      // Never writable and executable at once
+      std::memcpy (p, code.code.data (), size);
+      if (mprotect (p, size, PROT_READ | PROT_EXEC) != 0)
+      {
+        munmap (p, size);
+        return nullptr;
+      }
+
+      return uptr (new formula_program (p, size, code.constants));
+#else
+      (void) code;
+      return nullptr;
+#endif
+    }
+
+    ~formula_program () noexcept
+    {
+#ifdef MANDEL_FORMULA_JIT
+      munmap (pages, size);
+#endif
+    }
+
+    formula_program (formula_program const &)            = delete;
+    formula_program& operator= (formula_program const &)  = delete;
+
+    // Steps the 16 orbits starting at c steps times, see formula_code
+    std::uint32_t run (double const * c, std::uint32_t steps) const noexcept
+    {
+      return f (c, constants.data (), steps / 8, steps % 8);
+    }
+
+  private:
+    formula_program (void * pages, std::size_t size, std::vector<double> const & constants)
+      : pages     (pages)
+      , size      (size)
+      , constants (constants)
+    {
+      static_assert (sizeof (function) == sizeof (void *), "Code pages are called through a function pointer");
+      std::memcpy (&f, &pages, sizeof f);
+    }
+
+    void *              pages     ;
+    std::size_t         size      ;
+    std::vector<double> constants ;
+    function            f         ;
+  };
+
+  // The formula of the formula kernels, set before the first render
+  inline std::string & shared_formula ()
+  {
+    static std::string formula (default_formula);
+    return formula;
+  }
+
+  // shared_formula compiled, shared by the kernels rendering it. Null if it
+  //  doesn't compile or can't run here.
+  inline std::shared_ptr<formula_program const> shared_formula_program ()
+  {
+    static std::mutex                             lock;
+    static std::string                            compiled;
+    static std::shared_ptr<formula_program const> program;
+
+    std::lock_guard<std::mutex> guard (lock);
+
+    if (!program || compiled != shared_formula ())
+    {
+      formula_code code;
+      std::string error;
+      compiled  = shared_formula ();
+      program   = compile_formula (compiled.c_str (), code, error)
+        ? std::shared_ptr<formula_program const> (formula_program::create (code))
+        : nullptr
+        ;
+    }
+
+    return program;
+  }
+}
@@ -0,0 +1,2352 @@
+// ----------------------------------------------------------------------------------------------
+// Copyright 2017 Mårten Rånge
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------------------------
+
+// The kernel policies and the drivers that run them over a view on a
+//  schedule: rows, streams, hybrid and count tiles, levels, thumbnails, counts,
+//  queries, pans, deepening render sessions and orbit densities. A kernel
+//  policy looks like:
+//
+//    struct kernel
+//    {
+//      using kind = mandel::block_kind;      // or mandel::stream_kind
+//      static constexpr std::size_t rows = 2; // rows per compute_word, block_kind only
+//
+//      static char const * name () noexcept;  // selects the kernel on the command line
+//      static bool supported () noexcept;     // can the CPU run it?
+//
+//      explicit kernel (mandel::view const & v);
+//
+//      // block_kind: Computes bytes [ww, ww + bytes) of rows [y, y + rows).
+//      //  Row r is packed little endian into words[r] (zeroed by the caller).
+//      void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const;
+//
+//      // block_kind, optional: The lane utilisation of the render so far
+//      mandel::lane_stats stats () const;
+//
+//      // optional: Advances the orbits of query_group points by steps as
+//      //  compute_word does, x and y hold z and are updated. Bit i is set
+//      //  if point i hasn't escaped. Steps split over calls must round as
+//      //  in one, a render_session must land on the bits of a fresh render.
+//      //  render_session needs it.
+//      std::uint32_t advance (double const * cx, double const * cy, double * x, double * y, std::uint32_t steps) const;
+//
+//      // optional: As advance, also writes z before step s of point i to
+//      //  tx[s*query_group + i] and ty[s*query_group + i]. Used by
+//      //  compute_density.
+//      void trace (double const * cx, double const * cy, double * x, double * y, std::uint32_t steps, double * tx, double * ty) const;
+//
+//      // block_kind, optional: As compute_word for each of levels ascending
+//      //  iteration limits in one pass, v.max_iter is ignored. Row r of limit
+//      //  l goes to words[l*rows + r]. Used by compute_levels.
+//      void compute_levels (std::size_t y, std::size_t ww, std::size_t bytes, std::uint32_t const * limits, std::size_t levels, std::uint64_t * words) const;
+//
+//      // hybrid_kind: As compute_word but cheaper and less precise. unsure[r]
+//      //  marks the pixels of row r whose bits may be wrong, those that
+//      //  escaped late or came near |z|^2 = 4. compute_word is the precise
+//      //  pass.
+//      void compute_coarse_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words, std::uint64_t * unsure) const;
+//
+//      // hybrid_kind: false if the view is too deep for the coarse pass
+//      bool coarse_usable () const;
+//
+//      // stream_kind: Computes the pixels handed out by queue
+//      mandel::lane_stats compute_stream (mandel::bitmap & set, mandel::pixel_queue & queue) const;
+//
+//      // count_kind: Computes the escape counts of all tile_dim*tile_dim
+//      //  pixels of the tile starting at t, row by row. Pixels outside t.w
+//      //  and t.h are ignored.
+//      void compute_tile (mandel::tile const & t, std::uint16_t * counts) const;
+//    };
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <immintrin.h>
+
+#ifdef _MSVC_LANG
+# include <intrin.h>
+# define MANDEL_INLINE      __forceinline
+# define MANDEL_TARGET_AVX
+# define MANDEL_TARGET_AVX2
+#else
+# define MANDEL_INLINE      inline
+# define MANDEL_TARGET_AVX  __attribute__ ((target ("avx")))
+# define MANDEL_TARGET_AVX2 __attribute__ ((target ("avx2")))
+#endif
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include "bitmap_layouts.hpp"
+#include "worker_pool.hpp"
+
+namespace mandel
+{
+  constexpr auto    min_x     = -1.5;
+  constexpr auto    min_y     = -1.0;
+  constexpr auto    max_x     =  0.5;
+  constexpr auto    max_y     =  1.0;
+  constexpr auto    max_iter  =  50U;
+
+  // Rows handed out to a streaming worker at a time
+  constexpr auto    stream_band_rows = 8U;
+
+  // Rows in a band of the cyclic schedule, a multiple of every kernel's rows
+  constexpr auto    cyclic_band_rows = 8U;
+
+  // How rows are spread over threads
+  //  guided: OpenMP schedule(guided)
+  //  cyclic: worker t of T takes bands t, t + T, ... on the pinned worker_pool
+  //  serial: the calling thread computes all rows, no threads are started
+  enum class schedule
+  {
+    guided,
+    cyclic,
+    serial,
+  };
+
+  inline char const * schedule_name (schedule s) noexcept
+  {
+    switch (s)
+    {
+    case schedule::guided:
+      return "guided";
+    case schedule::cyclic:
+      return "cyclic";
+    case schedule::serial:
+      return "serial";
+    }
+    return "unknown";
+  }
+
+  // Maps the pixels of an x*y image onto the complex plane
+  struct view
+  {
+    std::size_t   x       ;
+    std::size_t   y       ;
+    double        min_x   ;
+    double        min_y   ;
+    double        max_x   ;
+    double        max_y   ;
+    double        scale_x ;
+    double        scale_y ;
+    std::uint32_t max_iter;
+  };
+
+  inline view make_view (
+      double        min_x
+    , double        min_y
+    , double        max_x
+    , double        max_y
+    , std::size_t   x
+    , std::size_t   y
+    , std::uint32_t iter
+    ) noexcept
+  {
+    return view
+    {
+      x
+    , y
+    , min_x
+    , min_y
+    , max_x
+    , max_y
+    , (max_x - min_x) / x
+    , (max_y - min_y) / y
+    , iter
+    };
+  }
+
+  inline view make_view (std::size_t dim, std::uint32_t iter) noexcept
+  {
+    return make_view (min_x, min_y, max_x, max_y, dim, dim, iter);
+  }
+
+  // Stores a row word of packed pixel bytes, byte b of the word holds pixel
+  //  byte b (little endian). A whole word is stored unless the row is ragged.
+  MANDEL_INLINE void store_word (std::uint8_t * p, std::uint64_t word, std::size_t bytes) noexcept
+  {
+    if (bytes == sizeof word)
+    {
+      std::memcpy (p, &word, sizeof word);
+    }
+    else
+    {
+      std::memcpy (p, &word, bytes);
+    }
+  }
+
+  MANDEL_INLINE std::uint32_t lowest_bit (std::uint32_t v) noexcept
+  {
+    assert (v);
+#ifdef _MSVC_LANG
+    unsigned long index;
+    _BitScanForward (&index, v);
+    return index;
+#else
+    return static_cast<std::uint32_t> (__builtin_ctz (v));
+#endif
+  }
+
+  // Runtime dispatch
+  //  Kernels using AVX are compiled with target attributes so a variant can be
+  //  built for a baseline x86-64 CPU and still pick the AVX kernels at runtime.
+
+  inline bool cpu_supports_avx () noexcept
+  {
+#ifdef _MSVC_LANG
+    int info[4];
+    __cpuid (info, 1);
+    auto osxsave  = (info[2] & (1 << 27)) != 0;
+    auto avx      = (info[2] & (1 << 28)) != 0;
+    // The OS must also preserve the YMM registers
+    return osxsave && avx && (_xgetbv (0) & 0x6) == 0x6;
+#else
+    return __builtin_cpu_supports ("avx");
+#endif
+  }
+
+  inline bool cpu_supports_avx2 () noexcept
+  {
+#ifdef _MSVC_LANG
+    int info[4];
+    __cpuidex (info, 7, 0);
+    return cpu_supports_avx () && (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports ("avx2");
+#endif
+  }
+
+  struct block_kind   {};
+  struct stream_kind  {};
+  struct count_kind   {};
+
+  // A block kernel with a cheaper, less precise first pass
+  struct hybrid_kind  : block_kind {};
+
+  struct lane_stats
+  {
+    std::uint64_t lane_steps  ; // lane slots stepped
+    std::uint64_t useful_steps; // steps that contributed to a pixel result
+
+    double utilisation () const noexcept
+    {
+      return lane_steps > 0
+        ? static_cast<double> (useful_steps) / lane_steps
+        : 0.0
+        ;
+    }
+  };
+
+  // Hands out the pixels of a bitmap to a streaming worker. Workers take bands
+  //  of rows from a shared counter so each worker owns whole bytes, or with
+  //  a stride the bands first, first + stride, ...
+  struct pixel_queue
+  {
+    pixel_queue (bitmap & set, std::atomic<std::size_t> & next_band) noexcept
+      : set       (set)
+      , next_band (&next_band)
+      , band      (0)
+      , stride    (0)
+      , x         (0)
+      , y         (0)
+      , end_y     (0)
+    {
+    }
+
+    pixel_queue (bitmap & set, std::size_t first_band, std::size_t stride) noexcept
+      : set       (set)
+      , next_band (nullptr)
+      , band      (first_band)
+      , stride    (stride)
+      , x         (0)
+      , y         (0)
+      , end_y     (0)
+    {
+    }
+
+    bool pop (std::size_t & px, std::size_t & py) noexcept
+    {
+      if (x >= set.x)
+      {
+        x = 0;
+        ++y;
+      }
+
+      if (y >= end_y)
+      {
+        auto b    = next_band
+          ? next_band->fetch_add (1, std::memory_order_relaxed)
+          : band
+          ;
+        band      += stride;
+        y         = b*stream_band_rows;
+        if (y >= set.y)
+        {
+          return false;
+        }
+        end_y     = std::min<std::size_t> (y + stream_band_rows, set.y);
+        x         = 0;
+        // Pixels are or:ed in as they are resolved
+        std::memset (set.bits () + y*set.w, 0, (end_y - y)*set.w);
+      }
+
+      px = x++;
+      py = y;
+      return true;
+    }
+
+  private:
+    bitmap &                    set       ;
+    std::atomic<std::size_t> *  next_band ;
+    std::size_t                 band      ;
+    std::size_t                 stride    ;
+    std::size_t                 x         ;
+    std::size_t                 y         ;
+    std::size_t                 end_y     ;
+  };
+
+  template<typename... kernels>
+  struct kernel_list {};
+
+  namespace details
+  {
+    // Runs f (b) for every block b of size points out of n
+    template<typename F>
+    void for_each_block (std::size_t n, std::size_t size, schedule sched, F const & f)
+    {
+      auto blocks = (n + size - 1) / size;
+
+      if (sched == schedule::serial)
+      {
+        for (auto b = 0U; b < blocks; ++b)
+        {
+          f (b);
+        }
+        return;
+      }
+
+      if (sched == schedule::cyclic)
+      {
+        auto & pool = shared_pool ();
+        auto stride = pool.size ();
+
+        pool.run ([&f, blocks, stride] (std::size_t t)
+        {
+          for (auto b = t; b < blocks; b += stride)
+          {
+            f (b);
+          }
+        });
+        return;
+      }
+
+      auto sblocks = static_cast<std::ptrdiff_t> (blocks);
+
+      #pragma omp parallel for schedule(guided)
+      for (auto b = std::ptrdiff_t (0); b < sblocks; ++b)
+      {
+        f (static_cast<std::size_t> (b));
+      }
+    }
+
+    // Computes the row group starting at y
+    // The set lies in the disk of radius 2 and a pixel outside it escapes at
+    //  the first step. Sets [b0, b1) to the bytes of rows [y, y + rows) with
+    //  pixels that may be inside the disk, b0 == b1 if there are none. A
+    //  pixel of margin on both sides covers the rounding of the kernels.
+    inline void disk_bytes (view const & v, std::size_t rows, std::size_t y, std::size_t & b0, std::size_t & b1) noexcept
+    {
+      auto width  = (v.x + 7) / 8;
+      auto min_y2 = 4.0;
+
+      for (auto r = 0U; r < rows && y + r < v.y; ++r)
+      {
+        auto cy = v.scale_y*(y + r) + v.min_y;
+        min_y2  = std::min (min_y2, cy*cy);
+      }
+
+      b0 = 0;
+      b1 = 0;
+
+      if (min_y2 >= 4.0)
+      {
+        return;
+      }
+
+      auto reach  = std::sqrt (4.0 - min_y2);
+      auto p0     = std::floor ((-reach - v.min_x) / v.scale_x) - 1;
+      auto p1     = std::ceil  (( reach - v.min_x) / v.scale_x) + 1;
+      auto bytes  = [width] (double p)
+      {
+        return p <= 0 ? 0 : p >= width*8.0 ? width : static_cast<std::size_t> (p) / 8;
+      };
+
+      b0 = bytes (p0);
+      b1 = std::max (b0, std::min (width, bytes (p1) + 1));
+    }
+
+    // Clears the bytes of rows [y, y + rows) outside [b0, b1) with wide
+    //  stores, zoomed out views are mostly made of them. The end of a row
+    //  and the start of the next are cleared as one run. False if no byte is
+    //  left to compute.
+    inline bool clear_outside (bitmap & set, std::size_t rows, std::size_t y, std::size_t b0, std::size_t b1) noexcept
+    {
+      auto width  = set.w;
+      auto row    = set.bits () + y*width;
+
+      rows        = std::min (rows, set.y - y);
+
+      if (b0 == b1)
+      {
+        std::memset (row, 0, rows*width);
+        return false;
+      }
+
+      std::memset (row, 0, b0);
+      for (auto r = 0U; r < rows; ++r)
+      {
+        std::memset (row + r*width + b1, 0, width - b1 + (r + 1 < rows ? b0 : 0));
+      }
+
+      return true;
+    }
+
+    // The row driver, every loop over the words of a row group goes through
+    //  it. Rows are collected into 64-bit words of up to 8 bytes, for each
+    //  word of bytes [b0, b1) compute (ww, bytes, words) fills words[n],
+    //  zeroed, and use (ww, bytes, words) takes them.
+    template<std::size_t n, typename compute_type, typename use_type>
+    MANDEL_INLINE void for_each_word (std::size_t b0, std::size_t b1, compute_type && compute, use_type && use)
+    {
+      for (auto ww = b0; ww < b1; ww += 8)
+      {
+        auto bytes = std::min<std::size_t> (8, b1 - ww);
+
+        std::uint64_t words[n] {};
+        compute (ww, bytes, words);
+        use (ww, bytes, static_cast<std::uint64_t const *> (words));
+      }
+    }
+
+    // A compute of for_each_word, the words of the row group at y from
+    //  compute_word
+    template<typename kernel>
+    MANDEL_INLINE auto block_words (kernel const & k, std::size_t y) noexcept
+    {
+      return [&k, y] (std::size_t ww, std::size_t bytes, std::uint64_t * words)
+      {
+        k.compute_word (y, ww, bytes, words);
+      };
+    }
+
+    // A use of for_each_word, stores word r to the row at rows + r*w for the
+    //  first lines words
+    inline auto store_rows (std::uint8_t * rows, std::size_t w, std::size_t lines) noexcept
+    {
+      return [rows, w, lines] (std::size_t ww, std::size_t bytes, std::uint64_t const * words)
+      {
+        for (auto r = 0U; r < lines; ++r)
+        {
+          store_word (rows + r*w + ww, words[r], bytes);
+        }
+      };
+    }
+
+    // Stores the words of the row group at y to its rows of set, those
+    //  inside the bitmap
+    inline auto store_rows (bitmap & set, std::size_t y, std::size_t rows) noexcept
+    {
+      return store_rows (set.bits () + y*set.w, set.w, std::min (rows, set.y - y));
+    }
+
+    // Computes bytes [b0, b1) of the row group at y
+    template<typename kernel>
+    MANDEL_INLINE void compute_bytes (kernel const & k, bitmap & set, std::size_t y, std::size_t b0, std::size_t b1)
+    {
+      for_each_word<kernel::rows> (b0, b1, block_words (k, y), store_rows (set, y, kernel::rows));
+    }
+
+    template<typename kernel>
+    MANDEL_INLINE void compute_rows (kernel const & k, view const & v, bitmap & set, std::size_t y)
+    {
+      std::size_t b0;
+      std::size_t b1;
+      disk_bytes (v, kernel::rows, y, b0, b1);
+
+      if (clear_outside (set, kernel::rows, y, b0, b1))
+      {
+        compute_bytes (k, set, y, b0, b1);
+      }
+    }
+
+    template<typename T, typename = void>
+    struct has_stats : std::false_type {};
+
+    template<typename T>
+    struct has_stats<T, decltype (std::declval<T const &> ().stats (), void ())>
+      : std::true_type {};
+
+    template<typename kernel>
+    lane_stats block_stats (kernel const & k, std::true_type)
+    {
+      return k.stats ();
+    }
+
+    template<typename kernel>
+    lane_stats block_stats (kernel const &, std::false_type)
+    {
+      return lane_stats {};
+    }
+
+    template<typename kernel>
+    lane_stats compute_set (kernel const & k, view const & v, bitmap & set, block_kind, schedule sched)
+    {
+      static_assert (cyclic_band_rows % kernel::rows == 0, "A cyclic band must hold whole row groups");
+
+      if (sched == schedule::serial)
+      {
+        for (auto y = 0U; y < v.y; y += kernel::rows)
+        {
+          compute_rows (k, v, set, y);
+        }
+
+        return block_stats (k, has_stats<kernel> {});
+      }
+
+      if (sched == schedule::cyclic)
+      {
+        auto & pool = shared_pool ();
+        auto stride = pool.size ();
+
+        pool.run ([&k, &v, &set, stride] (std::size_t t)
+        {
+          for (auto band = t; band*cyclic_band_rows < v.y; band += stride)
+          {
+            auto end_y = std::min<std::size_t> ((band + 1)*cyclic_band_rows, v.y);
+            for (auto y = band*cyclic_band_rows; y < end_y; y += kernel::rows)
+            {
+              compute_rows (k, v, set, y);
+            }
+          }
+        });
+
+        return block_stats (k, has_stats<kernel> {});
+      }
+
+      auto sheight  = static_cast<int> (v.y);
+      auto srows    = static_cast<int> (kernel::rows);
+
+      #pragma omp parallel for schedule(guided)
+      for (auto sy = 0; sy < sheight; sy += srows)
+      {
+        compute_rows (k, v, set, static_cast<std::size_t> (sy));
+      }
+
+      return block_stats (k, has_stats<kernel> {});
+    }
+
+    template<typename kernel>
+    lane_stats compute_set (kernel const & k, view const &, bitmap & set, stream_kind, schedule sched)
+    {
+      if (sched == schedule::serial)
+      {
+        auto queue = pixel_queue (set, 0, 1);
+        return k.compute_stream (set, queue);
+      }
+
+      if (sched == schedule::cyclic)
+      {
+        auto & pool = shared_pool ();
+        auto stride = pool.size ();
+
+        std::vector<lane_stats> stats (stride);
+
+        pool.run ([&k, &set, &stats, stride] (std::size_t t)
+        {
+          auto queue  = pixel_queue (set, t, stride);
+          stats[t]    = k.compute_stream (set, queue);
+        });
+
+        auto sum = lane_stats {};
+        for (auto & s : stats)
+        {
+          sum.lane_steps    += s.lane_steps;
+          sum.useful_steps  += s.useful_steps;
+        }
+        return sum;
+      }
+
+      std::atomic<std::size_t> next_band (0);
+
+      std::uint64_t lane_steps    = 0;
+      std::uint64_t useful_steps  = 0;
+
+      #pragma omp parallel reduction(+:lane_steps,useful_steps)
+      {
+        auto queue    = pixel_queue (set, next_band);
+        auto stats    = k.compute_stream (set, queue);
+        lane_steps    += stats.lane_steps;
+        useful_steps  += stats.useful_steps;
+      }
+
+      return lane_stats { lane_steps, useful_steps };
+    }
+
+    // Computes every tile of counts and runs stage (t, tile_counts) on each
+    //  tile on the same thread right after its compute
+    template<typename kernel, typename stage_type>
+    void compute_tiles (kernel const & k, tiled_counts & counts, schedule sched, stage_type const & stage)
+    {
+      auto tiles = counts.tiles ();
+
+      auto compute = [&k, &counts, &stage] (std::size_t i)
+      {
+        auto t = counts.tile_at (i);
+        auto c = counts.tile_counts (i);
+        k.compute_tile (t, c);
+        stage (t, static_cast<std::uint16_t const *> (c));
+      };
+
+      if (sched == schedule::serial)
+      {
+        for (auto i = 0U; i < tiles; ++i)
+        {
+          compute (i);
+        }
+        return;
+      }
+
+      if (sched == schedule::cyclic)
+      {
+        auto & pool = shared_pool ();
+        auto stride = pool.size ();
+
+        pool.run ([&compute, tiles, stride] (std::size_t t)
+        {
+          for (auto i = t; i < tiles; i += stride)
+          {
+            compute (i);
+          }
+        });
+        return;
+      }
+
+      auto stiles = static_cast<int> (tiles);
+
+      #pragma omp parallel for schedule(guided)
+      for (auto i = 0; i < stiles; ++i)
+      {
+        compute (static_cast<std::size_t> (i));
+      }
+    }
+
+    inline std::uint16_t inside_count (std::uint32_t max_iter) noexcept
+    {
+      return static_cast<std::uint16_t> (std::min (max_iter, max_count));
+    }
+
+    // Fused stage: sets the bits of the pixels of t inside the set
+    inline void threshold_tile (tile const & t, std::uint16_t const * counts, std::uint16_t inside, bitmap & set) noexcept
+    {
+      for (auto r = 0U; r < t.h; ++r)
+      {
+        auto row  = counts + r*tile_dim;
+        auto bits = set.bits () + (t.y0 + r)*set.w + t.x0/8;
+
+        for (auto b = 0U; b < (t.w + 7) / 8; ++b)
+        {
+          auto byte = 0U;
+          for (auto j = 0U; j < 8; ++j)
+          {
+            byte = (byte << 1) | (row[b*8 + j] >= inside ? 1U : 0U);
+          }
+          bits[b] = static_cast<std::uint8_t> (byte);
+        }
+      }
+    }
+
+    // Fused stage: shades the pixels of t, inside is black and the slower a
+    //  pixel escapes the darker it is
+    inline void grey_tile (tile const & t, std::uint16_t const * counts, std::uint16_t inside, greymap & grey) noexcept
+    {
+      auto scale = 255.0F / inside;
+
+      for (auto r = 0U; r < t.h; ++r)
+      {
+        auto row    = counts + r*tile_dim;
+        auto pixels = grey.pixels () + (t.y0 + r)*grey.x + t.x0;
+
+        for (auto j = 0U; j < t.w; ++j)
+        {
+          pixels[j] = row[j] >= inside
+            ? 0
+            : static_cast<std::uint8_t> (255 - static_cast<int> (row[j]*scale))
+            ;
+        }
+      }
+    }
+
+    template<typename kernel>
+    lane_stats compute_set (kernel const & k, view const & v, bitmap & set, count_kind, schedule sched)
+    {
+      tiled_counts counts (v.x, v.y);
+      auto inside = inside_count (v.max_iter);
+
+      compute_tiles (k, counts, sched, [inside, &set] (tile const & t, std::uint16_t const * c)
+      {
+        threshold_tile (t, c, inside, set);
+      });
+
+      return lane_stats {};
+    }
+
+    // In the main cardioid or the period 2 bulb, such points never escape
+    inline bool in_bulbs (double cx, double cy) noexcept
+    {
+      auto x  = cx - 0.25;
+      auto y2 = cy*cy;
+      auto q  = x*x + y2;
+      auto bx = cx + 1;
+      return q*(q + x) <= 0.25*y2 || bx*bx + y2 <= 0.0625;
+    }
+
+    // Pixels of a coarse word that are inside but not in the bulbs, a
+    //  coarse pass can't tell them from pixels that escape after many steps
+    inline std::uint64_t outside_bulbs (view const & v, std::size_t y, std::size_t ww, std::uint64_t inside) noexcept
+    {
+      auto cy     = v.scale_y*y + v.min_y;
+      auto result = std::uint64_t (0);
+
+      for (auto bit = 0U; bit < 64; ++bit)
+      {
+        // Byte j of a word is byte ww + j of the row, its MSB the leftmost pixel
+        auto x = (ww + bit / 8)*8 + 7 - bit % 8;
+        if ((inside >> bit & 1U) && !in_bulbs (v.scale_x*x + v.min_x, cy))
+        {
+          result |= std::uint64_t (1) << bit;
+        }
+      }
+
+      return result;
+    }
+
+    // Computes the row group at y with the coarse pass, then refines the
+    //  bytes it may have wrong with the precise pass, a word at a time. A
+    //  byte is refined if any of its pixels is unsure or if it is mixed,
+    //  pixels inside and outside.
+    template<typename kernel>
+    void compute_hybrid_rows (kernel const & k, view const & v, bitmap & set, std::size_t y)
+    {
+      auto rows     = std::min (kernel::rows, v.y - y);
+      auto precise  = block_words (k, y);
+
+      auto compute  = [&] (std::size_t ww, std::size_t bytes, std::uint64_t * words)
+      {
+        std::uint64_t unsure[kernel::rows] {};
+        k.compute_coarse_word (y, ww, bytes, words, unsure);
+
+        auto refine = 0U;
+        for (auto r = 0U; r < rows; ++r)
+        {
+          unsure[r] |= outside_bulbs (v, y + r, ww, words[r]);
+
+          for (auto b = 0U; b < bytes; ++b)
+          {
+            auto c = static_cast<std::uint8_t> (words[r] >> 8*b);
+            if (static_cast<std::uint8_t> (unsure[r] >> 8*b) != 0 || (c != 0 && c != 0xFF))
+            {
+              refine |= 1U << b;
+            }
+          }
+        }
+
+        // Runs of bytes to refine go to compute_word together
+        for (auto b = 0U; b < bytes;)
+        {
+          if (!(refine >> b & 1U))
+          {
+            ++b;
+            continue;
+          }
+
+          auto e = b + 1;
+          while (e < bytes && (refine >> e & 1U))
+          {
+            ++e;
+          }
+
+          std::uint64_t refined[kernel::rows] {};
+          precise (ww + b, e - b, refined);
+
+          auto mask = (e - b == 8 ? ~std::uint64_t (0) : (std::uint64_t (1) << 8*(e - b)) - 1) << 8*b;
+          for (auto r = 0U; r < rows; ++r)
+          {
+            words[r] = (words[r] & ~mask) | (refined[r] << 8*b);
+          }
+
+          b = e;
+        }
+      };
+
+      for_each_word<kernel::rows> (0, set.w, compute, store_rows (set, y, rows));
+    }
+
+    template<typename kernel>
+    lane_stats compute_set (kernel const & k, view const & v, bitmap & set, hybrid_kind, schedule sched)
+    {
+      if (!k.coarse_usable ())
+      {
+        return compute_set (k, v, set, block_kind {}, sched);
+      }
+
+      auto groups = (v.y + kernel::rows - 1) / kernel::rows;
+
+      for_each_block (groups, 1, sched, [&k, &v, &set] (std::size_t g)
+      {
+        compute_hybrid_rows (k, v, set, g*kernel::rows);
+      });
+
+      return lane_stats {};
+    }
+
+    inline void print_kernels (std::FILE * log, kernel_list<>)
+    {
+      std::fprintf (log, "\n");
+    }
+
+    template<typename kernel, typename... rest>
+    void print_kernels (std::FILE * log, kernel_list<kernel, rest...>)
+    {
+      std::fprintf (log, " %s", kernel::name ());
+      print_kernels (log, kernel_list<rest...> {});
+    }
+  }
+
+  template<typename kernel>
+  lane_stats compute_into (view const & v, schedule sched, bitmap & set)
+  {
+    assert (set.x == v.x && set.y == v.y);
+    auto k = kernel (v);
+    return details::compute_set (k, v, set, typename kernel::kind {}, sched);
+  }
+
+  template<typename kernel>
+  std::tuple<bitmap::uptr, lane_stats> compute_set (view const & v, schedule sched = schedule::guided)
+  {
+    auto set    = create_bitmap (v.x, v.y);
+    auto stats  = compute_into<kernel> (v, sched, *set);
+    return std::make_tuple (std::move (set), stats);
+  }
+
+  namespace details
+  {
+    // Computes the tile at rank rank, a tile row is the word of compute_word
+    //  shifted to the bytes of the tile it covers
+    template<typename kernel>
+    void compute_bitmap_tile (kernel const & k, view const & v, tiled_bitmap & set, std::size_t rank)
+    {
+      static_assert (tile_dim % kernel::rows == 0, "A tile must hold whole row groups");
+
+      auto i      = set.tile_at_rank (rank);
+      auto tile   = set.tile_bits (rank);
+      auto y0     = (i / set.tiles_x)*tile_dim;
+      auto t0     = (i % set.tiles_x)*tiled_bitmap::tile_w;
+      auto t1     = std::min (t0 + tiled_bitmap::tile_w, set.w);
+
+      std::memset (tile, 0, tiled_bitmap::tile_bytes);
+
+      for (auto r = 0U; r < tile_dim && y0 + r < v.y; r += kernel::rows)
+      {
+        std::size_t b0;
+        std::size_t b1;
+        disk_bytes (v, kernel::rows, y0 + r, b0, b1);
+
+        b0 = std::max (b0, t0);
+        b1 = std::min (b1, t1);
+        if (b0 >= b1)
+        {
+          continue;
+        }
+
+        // [b0, b1) is within the tile, one word shifted to the bytes of
+        //  the tile it covers
+        auto lines = std::min (kernel::rows, v.y - y0 - r);
+        for_each_word<kernel::rows> (b0, b1, block_words (k, y0 + r), [&] (std::size_t, std::size_t, std::uint64_t const * words)
+        {
+          for (auto rr = 0U; rr < lines; ++rr)
+          {
+            auto word = words[rr] << 8*(b0 - t0);
+            std::memcpy (tile + (r + rr)*tiled_bitmap::tile_w, &word, sizeof word);
+          }
+        });
+      }
+    }
+
+    template<typename kernel>
+    void compute_tiles (kernel const & k, view const & v, tiled_bitmap & set, block_kind, schedule sched)
+    {
+      // Ranks are handed out in Z-order, a worker writes whole tiles so no
+      //  cache line of the bitmap is written by two workers
+      for_each_block (set.tiles (), 1, sched, [&k, &v, &set] (std::size_t rank)
+      {
+        compute_bitmap_tile (k, v, set, rank);
+      });
+    }
+  }
+
+  // Renders v into a tiled_bitmap, block kernels only
+  template<typename kernel>
+  tiled_bitmap::uptr compute_tiled (view const & v, schedule sched = schedule::guided)
+  {
+    auto set  = std::make_unique<tiled_bitmap> (v.x, v.y);
+    auto k    = kernel (v);
+    details::compute_tiles (k, v, *set, typename kernel::kind {}, sched);
+    return set;
+  }
+
+  // Converts tiles to a row major bitmap, a band of tile_dim rows at a time
+  inline bitmap::uptr to_bitmap (tiled_bitmap const & tiles, schedule sched = schedule::guided)
+  {
+    auto set = create_bitmap (tiles.x, tiles.y);
+    details::for_each_block (tiles.tiles_y, 1, sched, [&tiles, &set] (std::size_t ty)
+    {
+      tiles.copy_band (ty, set->bits () + ty*tile_dim*set->w);
+    });
+    return set;
+  }
+
+  // Iteration limits rendered by one compute_levels pass at most
+  constexpr std::size_t max_levels = 8;
+
+  namespace details
+  {
+    template<typename T, typename = void>
+    struct has_levels : std::false_type {};
+
+    template<typename T>
+    struct has_levels<T, decltype (std::declval<T const &> ().compute_levels (0U, 0U, 0U, nullptr, 0U, nullptr), void ())>
+      : std::true_type {};
+
+    // Computes the row group starting at y for every limit
+    template<typename kernel>
+    void compute_level_rows (kernel const & k, view const & v, std::vector<std::uint32_t> const & limits, std::vector<bitmap::uptr> & sets, std::size_t y)
+    {
+      auto levels = limits.size ();
+
+      // A pixel outside the disk escapes at the first step, whatever the
+      //  limit
+      std::size_t b0;
+      std::size_t b1;
+      disk_bytes (v, kernel::rows, y, b0, b1);
+
+      for (auto & set : sets)
+      {
+        clear_outside (*set, kernel::rows, y, b0, b1);
+      }
+
+      auto compute = [&] (std::size_t ww, std::size_t bytes, std::uint64_t * words)
+      {
+        k.compute_levels (y, ww, bytes, limits.data (), levels, words);
+      };
+
+      for_each_word<max_levels*kernel::rows> (b0, b1, compute, [&] (std::size_t ww, std::size_t bytes, std::uint64_t const * words)
+      {
+        for (auto l = 0U; l < levels; ++l)
+        {
+          store_rows (*sets[l], y, kernel::rows) (ww, bytes, words + l*kernel::rows);
+        }
+      });
+    }
+
+    template<typename kernel>
+    void compute_levels (view const & v, std::vector<std::uint32_t> const & limits, std::vector<bitmap::uptr> & sets, schedule sched, std::true_type)
+    {
+      auto k      = kernel (v);
+      auto groups = (v.y + kernel::rows - 1) / kernel::rows;
+
+      for_each_block (groups, 1, sched, [&] (std::size_t g)
+      {
+        compute_level_rows (k, v, limits, sets, g*kernel::rows);
+      });
+    }
+
+    // Without compute_levels every limit is a render of its own
+    template<typename kernel>
+    void compute_levels (view const & v, std::vector<std::uint32_t> const & limits, std::vector<bitmap::uptr> & sets, schedule sched, std::false_type)
+    {
+      for (auto l = 0U; l < limits.size (); ++l)
+      {
+        auto lv     = v;
+        lv.max_iter = limits[l];
+        compute_into<kernel> (lv, sched, *sets[l]);
+      }
+    }
+  }
+
+  // Renders v at each of the ascending iteration limits, at most max_levels
+  //  of them. Kernels with compute_levels render all of them in one pass as
+  //  deep as the last limit, a pixel's bit at a limit is taken as its orbit
+  //  passes it. v.max_iter is ignored.
+  template<typename kernel>
+  std::vector<bitmap::uptr> compute_levels (view const & v, std::vector<std::uint32_t> const & limits, schedule sched = schedule::guided)
+  {
+    assert (!limits.empty () && limits.size () <= max_levels);
+    assert (std::is_sorted (limits.begin (), limits.end ()));
+
+    std::vector<bitmap::uptr> sets;
+    for (auto i = 0U; i < limits.size (); ++i)
+    {
+      sets.push_back (create_bitmap (v.x, v.y));
+    }
+
+    details::compute_levels<kernel> (v, limits, sets, sched, details::has_levels<kernel> {});
+
+    return sets;
+  }
+
+  // Computes the escape counts of v and shades them into a greymap in the
+  //  same pass
+  template<typename kernel>
+  std::tuple<greymap::uptr, tiled_counts::uptr> compute_greymap (view const & v, schedule sched)
+  {
+    auto grey   = std::make_unique<greymap> (v.x, v.y);
+    auto counts = std::make_unique<tiled_counts> (v.x, v.y);
+    auto inside = details::inside_count (v.max_iter);
+    auto k      = kernel (v);
+    auto & g    = *grey;
+
+    details::compute_tiles (k, *counts, sched, [inside, &g] (tile const & t, std::uint16_t const * c)
+    {
+      details::grey_tile (t, c, inside, g);
+    });
+
+    return std::make_tuple (std::move (grey), std::move (counts));
+  }
+
+  // Anti-aliased thumbnails sample every greymap pixel aa_factor*aa_factor
+  //  times, the pixel is the share of the samples outside the set
+  constexpr std::size_t aa_factor = 4;
+
+  namespace details
+  {
+    // Renders the sample rows of thumbnail row ty with a block kernel into
+    //  rows, aa_factor rows of w bytes, and shades them into grey. Only these
+    //  rows of the supersampled bitmap ever exist.
+    template<typename kernel>
+    void compute_thumbnail_row (kernel const & k, std::size_t ty, std::uint8_t * rows, std::size_t w, greymap & grey)
+    {
+      static_assert (aa_factor % kernel::rows == 0, "A thumbnail row must hold whole row groups");
+      static_assert (aa_factor == 4, "Shading assumes a nibble of samples per pixel and row");
+
+      // Samples inside per nibble
+      static std::uint8_t const inside[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+      for (auto r = 0U; r < aa_factor; r += kernel::rows)
+      {
+        for_each_word<kernel::rows> (0, w, block_words (k, ty*aa_factor + r), store_rows (rows + r*w, w, kernel::rows));
+      }
+
+      // Sample bits are MSB first, pixel 2b is the high nibble of byte b
+      auto pixels = grey.pixels () + ty*grey.x;
+      for (auto x = 0U; x < grey.x; ++x)
+      {
+        auto b      = x / 2;
+        auto shift  = x % 2 == 0 ? 4 : 0;
+        auto n      = 0U;
+        for (auto r = 0U; r < aa_factor; ++r)
+        {
+          n += inside[(rows[r*w + b] >> shift) & 0xF];
+        }
+        pixels[x] = static_cast<std::uint8_t> (255 - n*255 / (aa_factor*aa_factor));
+      }
+    }
+
+    template<typename kernel>
+    void compute_thumbnail (kernel const & k, view const & sv, greymap & grey, schedule sched)
+    {
+      auto w = (sv.x + 7) / 8;
+
+      if (sched == schedule::serial)
+      {
+        std::vector<std::uint8_t> rows (aa_factor*w);
+        for (auto ty = 0U; ty < grey.y; ++ty)
+        {
+          compute_thumbnail_row (k, ty, rows.data (), w, grey);
+        }
+        return;
+      }
+
+      if (sched == schedule::cyclic)
+      {
+        auto & pool = shared_pool ();
+        auto stride = pool.size ();
+
+        pool.run ([&k, &grey, w, stride] (std::size_t t)
+        {
+          std::vector<std::uint8_t> rows (aa_factor*w);
+          for (auto ty = t; ty < grey.y; ty += stride)
+          {
+            compute_thumbnail_row (k, ty, rows.data (), w, grey);
+          }
+        });
+        return;
+      }
+
+      auto sheight = static_cast<int> (grey.y);
+
+      #pragma omp parallel
+      {
+        std::vector<std::uint8_t> rows (aa_factor*w);
+
+        #pragma omp for schedule(guided)
+        for (auto ty = 0; ty < sheight; ++ty)
+        {
+          compute_thumbnail_row (k, static_cast<std::size_t> (ty), rows.data (), w, grey);
+        }
+      }
+    }
+  }
+
+  // Renders an anti-aliased greyscale thumbnail of v with a block kernel,
+  //  the supersampled bitmap is popcounted row by row as it is computed
+  template<typename kernel>
+  greymap::uptr compute_thumbnail (view const & v, schedule sched)
+  {
+    auto grey = std::make_unique<greymap> (v.x, v.y);
+    auto sv   = make_view (v.min_x, v.min_y, v.max_x, v.max_y, v.x*aa_factor, v.y*aa_factor, v.max_iter);
+    auto k    = kernel (sv);
+
+    details::compute_thumbnail (k, sv, *grey, sched);
+
+    return grey;
+  }
+
+  // Pixels of a view inside the set, counted without a bitmap
+  struct area_count
+  {
+    std::uint64_t inside; // pixels inside
+    std::uint64_t edges ; // pixels whose right neighbour is of the other kind
+
+    // The area of the set the view covers, each pixel stands for the square
+    //  around its point
+    double area (view const & v) const noexcept
+    {
+      return inside*v.scale_x*v.scale_y;
+    }
+
+    // A rough size of the error of area, not a bound. The boundary crosses
+    //  about twice as many pixels as there are edges in the rows and those
+    //  are the pixels that may be counted wrong. Edges finer than a pixel
+    //  and escapes past max_iter are not seen.
+    double error_estimate (view const & v) const noexcept
+    {
+      return 2.0*edges*v.scale_x*v.scale_y;
+    }
+  };
+
+  namespace details
+  {
+    MANDEL_INLINE std::uint64_t popcount (std::uint64_t v) noexcept
+    {
+      v = v - ((v >> 1) & 0x5555555555555555ULL);
+      v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+      v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+      return (v*0x0101010101010101ULL) >> 56;
+    }
+
+    // Counts the row group starting at y into c
+    template<typename kernel>
+    void count_rows (kernel const & k, view const & v, std::size_t y, area_count & c)
+    {
+      std::size_t b0;
+      std::size_t b1;
+      disk_bytes (v, kernel::rows, y, b0, b1);
+
+      // The last pixel of the previous word per row
+      std::uint64_t last[kernel::rows] {};
+
+      for_each_word<kernel::rows> (b0, b1, block_words (k, y), [&] (std::size_t ww, std::size_t bytes, std::uint64_t const * words)
+      {
+        // Pixels are MSB first in the bytes of a little endian word, the
+        //  last pixel of byte i is bit 8i and the first of byte i + 1 is
+        //  bit 8i + 15
+        auto between = 0x0101010101010101ULL & ((1ULL << 8*(bytes - 1)) - 1);
+
+        for (auto r = 0U; r < kernel::rows && y + r < v.y; ++r)
+        {
+          auto w    = words[r];
+          c.inside  += popcount (w);
+          c.edges   += popcount ((w ^ (w >> 1)) & 0x7F7F7F7F7F7F7F7FULL);
+          c.edges   += popcount ((w ^ (w >> 15)) & between);
+          c.edges   += ww > b0 ? ((w >> 7) & 1) ^ last[r] : 0;
+          last[r]   = (w >> 8*(bytes - 1)) & 1;
+        }
+      });
+    }
+  }
+
+  // Counts the pixels of v inside the set with a block kernel. The words of
+  //  a row group are popcounted as they are computed, so views far too
+  //  large for a bitmap are counted in constant memory.
+  template<typename kernel>
+  area_count count_set (view const & v, schedule sched = schedule::guided)
+  {
+    static_assert (std::is_base_of<block_kind, typename kernel::kind>::value, "Counting needs a block kernel");
+
+    auto k      = kernel (v);
+    auto groups = (v.y + kernel::rows - 1) / kernel::rows;
+
+    std::atomic<std::uint64_t> inside (0);
+    std::atomic<std::uint64_t> edges (0);
+
+    // Each block sums locally and adds once
+    details::for_each_block (groups, cyclic_band_rows / kernel::rows, sched, [&] (std::size_t b)
+    {
+      auto c  = area_count {};
+      auto g0 = b*(cyclic_band_rows / kernel::rows);
+      auto g1 = std::min<std::size_t> (g0 + cyclic_band_rows / kernel::rows, groups);
+      for (auto g = g0; g < g1; ++g)
+      {
+        details::count_rows (k, v, g*kernel::rows, c);
+      }
+      inside.fetch_add (c.inside, std::memory_order_relaxed);
+      edges.fetch_add (c.edges, std::memory_order_relaxed);
+    });
+
+    return area_count { inside.load (), edges.load () };
+  }
+
+  // Bulk queries
+  //  Answer membership or escape counts for scattered points given as SoA
+  //  arrays of cx and cy. A kernel supporting them answers query_group points
+  //  per call:
+  //
+  //    // counts[i] is the escape count of point i, max_iter if inside
+  //    void query_counts (double const * cx, double const * cy, std::uint32_t * counts) const;
+  //
+  //    // Bit i is set if point i is inside
+  //    std::uint32_t query_inside (double const * cx, double const * cy) const;
+  //
+  //  A group runs until its slowest point is done, scattered points in input
+  //  order mix fast and slow points in most groups. query_order::spatial
+  //  sorts each chunk of query_chunk points so neighbours, which tend to
+  //  escape at about the same count, share groups. The results are still in
+  //  input order. The sort costs a few iterations per point, it pays off
+  //  from a max_iter of a few hundred.
+
+  constexpr std::size_t query_group = 16;
+  constexpr std::size_t query_chunk = 2048;
+
+  enum class query_order
+  {
+    input   , // as given
+    spatial , // per chunk, points known to be inside first, the rest in Morton order
+  };
+
+  namespace details
+  {
+    template<typename T, typename = void>
+    struct has_query_counts : std::false_type {};
+
+    template<typename T>
+    struct has_query_counts<T, decltype (std::declval<T const &> ().query_counts (nullptr, nullptr, nullptr), void ())>
+      : std::true_type {};
+
+    template<typename T, typename = void>
+    struct has_query_inside : std::false_type {};
+
+    template<typename T>
+    struct has_query_inside<T, decltype (std::declval<T const &> ().query_inside (nullptr, nullptr), void ())>
+      : std::true_type {};
+
+    // The points of a group, padded past n with a point that escapes at once
+    //  so a partial group costs no more than its real points
+    struct query_points
+    {
+      alignas (32) double cx[query_group];
+      alignas (32) double cy[query_group];
+
+      query_points (std::size_t n, double const * pcx, double const * pcy) noexcept
+      {
+        for (auto i = 0U; i < query_group; ++i)
+        {
+          cx[i] = i < n ? pcx[i] : 4.0;
+          cy[i] = i < n ? pcy[i] : 4.0;
+        }
+      }
+    };
+
+    // The points of a chunk in spatial order, order[i] is the index in the
+    //  chunk of point i. Points are bucketed by 1 bit for points outside the
+    //  bulbs and the Morton code of their cell on a grid over the bounding box
+    //  of the chunk, about 32 points per cell. Sorting a chunk at a time keeps
+    //  the counting sort in cache, a global sort of a million points costs
+    //  more than the iterations it saves at low max_iter.
+    struct sorted_chunk
+    {
+      static constexpr auto bits  = 3U;
+      static constexpr auto out   = 1U << (2*bits);
+
+      std::size_t                 n                   ;
+      std::uint16_t               order [query_chunk] ;
+      alignas (32) double         cx    [query_chunk] {};
+      alignas (32) double         cy    [query_chunk] {};
+
+      sorted_chunk (std::size_t count, double const * pcx, double const * pcy) noexcept
+        : n (count)
+      {
+        auto bx0 = n > 0 ? pcx[0] : 0.0;
+        auto by0 = n > 0 ? pcy[0] : 0.0;
+        auto bx1 = bx0;
+        auto by1 = by0;
+        for (auto i = 0U; i < n; ++i)
+        {
+          bx0 = std::min (bx0, pcx[i]);
+          by0 = std::min (by0, pcy[i]);
+          bx1 = std::max (bx1, pcx[i]);
+          by1 = std::max (by1, pcy[i]);
+        }
+
+        auto cells  = static_cast<double> (1U << bits);
+        auto sx     = bx1 > bx0 ? (cells - 0.5) / (bx1 - bx0) : 0.0;
+        auto sy     = by1 > by0 ? (cells - 0.5) / (by1 - by0) : 0.0;
+
+        std::uint8_t  keys    [query_chunk] ;
+        std::uint16_t offsets [2*out + 1]   {};
+        for (auto i = 0U; i < n; ++i)
+        {
+          auto qx = static_cast<std::uint32_t> ((pcx[i] - bx0)*sx);
+          auto qy = static_cast<std::uint32_t> ((pcy[i] - by0)*sy);
+          keys[i] = static_cast<std::uint8_t> ((in_bulbs (pcx[i], pcy[i]) ? 0U : out) | spread_bits (qx) | (spread_bits (qy) << 1));
+          ++offsets[keys[i] + 1];
+        }
+
+        for (auto k = 0U; k < 2*out; ++k)
+        {
+          offsets[k + 1] = static_cast<std::uint16_t> (offsets[k + 1] + offsets[k]);
+        }
+
+        for (auto i = 0U; i < n; ++i)
+        {
+          auto at   = offsets[keys[i]]++;
+          order[at] = static_cast<std::uint16_t> (i);
+          cx[at]    = pcx[i];
+          cy[at]    = pcy[i];
+        }
+      }
+    };
+
+    // Escape counts of n points, group by group
+    template<typename kernel>
+    void query_counts (kernel const & k, std::size_t n, double const * cx, double const * cy, std::uint32_t * counts)
+    {
+      for (auto first = std::size_t (0); first < n; first += query_group)
+      {
+        if (first + query_group <= n)
+        {
+          k.query_counts (cx + first, cy + first, counts + first);
+          continue;
+        }
+
+        auto points = query_points (n - first, cx + first, cy + first);
+        std::uint32_t group_counts[query_group];
+        k.query_counts (points.cx, points.cy, group_counts);
+        std::copy (group_counts, group_counts + (n - first), counts + first);
+      }
+    }
+
+    // In-set bits of n points, group by group, LSB first
+    template<typename kernel>
+    void query_inside (kernel const & k, std::size_t n, double const * cx, double const * cy, std::uint8_t * inside)
+    {
+      for (auto first = std::size_t (0); first < n; first += query_group)
+      {
+        auto left = std::min (query_group, n - first);
+
+        std::uint32_t bits;
+        if (left == query_group)
+        {
+          bits = k.query_inside (cx + first, cy + first);
+        }
+        else
+        {
+          auto points = query_points (left, cx + first, cy + first);
+          bits        = k.query_inside (points.cx, points.cy);
+        }
+
+        std::uint8_t bytes[2] { static_cast<std::uint8_t> (bits), static_cast<std::uint8_t> (bits >> 8) };
+        std::memcpy (inside + first/8, bytes, (left + 7) / 8);
+      }
+    }
+  }
+
+  // Writes the escape count of point i to counts[i], max_iter if inside
+  template<typename kernel>
+  void query_counts (
+      std::size_t     n
+    , double const *  cx
+    , double const *  cy
+    , std::uint32_t   max_iter
+    , std::uint32_t * counts
+    , schedule        sched = schedule::guided
+    , query_order     order = query_order::input
+    )
+  {
+    auto k = kernel (make_view (query_group, max_iter));
+
+    if (order == query_order::input)
+    {
+      details::for_each_block (n, query_group, sched, [&k, n, cx, cy, counts] (std::size_t g)
+      {
+        auto first = g*query_group;
+        details::query_counts (k, std::min (query_group, n - first), cx + first, cy + first, counts + first);
+      });
+      return;
+    }
+
+    details::for_each_block (n, query_chunk, sched, [&k, n, cx, cy, counts] (std::size_t c)
+    {
+      auto first  = c*query_chunk;
+      details::sorted_chunk sorted (std::min (query_chunk, n - first), cx + first, cy + first);
+
+      std::uint32_t sorted_counts[query_chunk];
+      details::query_counts (k, sorted.n, sorted.cx, sorted.cy, sorted_counts);
+
+      for (auto i = 0U; i < sorted.n; ++i)
+      {
+        counts[first + sorted.order[i]] = sorted_counts[i];
+      }
+    });
+  }
+
+  // Sets bit i % 8 of inside[i / 8] if point i is inside, LSB first. inside
+  //  holds (n + 7) / 8 bytes.
+  template<typename kernel>
+  void query_inside (
+      std::size_t     n
+    , double const *  cx
+    , double const *  cy
+    , std::uint32_t   max_iter
+    , std::uint8_t *  inside
+    , schedule        sched = schedule::guided
+    , query_order     order = query_order::input
+    )
+  {
+    auto k = kernel (make_view (query_group, max_iter));
+
+    if (order == query_order::input)
+    {
+      details::for_each_block (n, query_group, sched, [&k, n, cx, cy, inside] (std::size_t g)
+      {
+        auto first = g*query_group;
+        details::query_inside (k, std::min (query_group, n - first), cx + first, cy + first, inside + first/8);
+      });
+      return;
+    }
+
+    details::for_each_block (n, query_chunk, sched, [&k, n, cx, cy, inside] (std::size_t c)
+    {
+      auto first  = c*query_chunk;
+      details::sorted_chunk sorted (std::min (query_chunk, n - first), cx + first, cy + first);
+
+      std::uint8_t sorted_inside[query_chunk/8];
+      details::query_inside (k, sorted.n, sorted.cx, sorted.cy, sorted_inside);
+
+      std::uint8_t chunk_inside[query_chunk/8] {};
+      for (auto i = 0U; i < sorted.n; ++i)
+      {
+        auto j = sorted.order[i];
+        chunk_inside[j / 8] |= static_cast<std::uint8_t> (((sorted_inside[i / 8] >> (i % 8)) & 1U) << (j % 8));
+      }
+
+      std::memcpy (inside + first/8, chunk_inside, (sorted.n + 7) / 8);
+    });
+  }
+
+  // Incremental pans
+  //  A pan by whole pixels keeps the scale, so most pixels of the new render
+  //  are pixels of the previous one moved by (dx, dy). compute_pan bit shifts
+  //  those out of the previous render and only runs the kernel on the
+  //  exposed strips. Pixels are the same as a full render up to the rounding
+  //  of the panned viewport's corner, none on a view from snap_view.
+
+  // v moved by dx, dy pixels with the same scale
+  inline view pan_view (view const & v, std::ptrdiff_t dx, std::ptrdiff_t dy) noexcept
+  {
+    auto pv   = v;
+    pv.min_x  = v.min_x + static_cast<double> (dx)*v.scale_x;
+    pv.min_y  = v.min_y + static_cast<double> (dy)*v.scale_y;
+    pv.max_x  = pv.min_x + static_cast<double> (v.x)*v.scale_x;
+    pv.max_y  = pv.min_y + static_cast<double> (v.y)*v.scale_y;
+    return pv;
+  }
+
+  // v moved onto a grid where its pixel coordinates are exact. The scales
+  //  are rounded to 21 significant bits and the corner to a multiple of the
+  //  last of them, so min + x*scale is a whole number, under 2^53, of that
+  //  bit and the kernels compute it without rounding, in any order. A pan of
+  //  the view by whole pixels stays on the grid and its pixels are the same
+  //  points as those of the render it was panned from. Corners more than
+  //  2^31 pixels from 0 don't fit.
+  inline view snap_view (view const & v) noexcept
+  {
+    auto snap = [] (double & min, double & scale)
+    {
+      auto e    = 0;
+      std::frexp (scale, &e);
+      auto unit = std::ldexp (1.0, e - 21);
+      scale     = std::round (scale / unit)*unit;
+      min       = std::round (min / unit)*unit;
+    };
+
+    auto sv   = v;
+    snap (sv.min_x, sv.scale_x);
+    snap (sv.min_y, sv.scale_y);
+    sv.max_x  = sv.min_x + static_cast<double> (v.x)*sv.scale_x;
+    sv.max_y  = sv.min_y + static_cast<double> (v.y)*sv.scale_y;
+    return sv;
+  }
+
+  // Finds the whole pixel offset from a render of from to a render of to,
+  //  false unless they have the same size, scale and max_iter and the offset
+  //  is within 1/1000 of a pixel of a whole pixel
+  inline bool pan_offset (view const & from, view const & to, std::ptrdiff_t & dx, std::ptrdiff_t & dy) noexcept
+  {
+    auto same_scale = [] (double a, double b)
+    {
+      return std::abs (a - b) <= 1E-9*std::abs (a);
+    };
+
+    if (from.x != to.x || from.y != to.y || from.max_iter != to.max_iter)
+    {
+      return false;
+    }
+
+    if (!same_scale (from.scale_x, to.scale_x) || !same_scale (from.scale_y, to.scale_y))
+    {
+      return false;
+    }
+
+    auto fx = (to.min_x - from.min_x) / from.scale_x;
+    auto fy = (to.min_y - from.min_y) / from.scale_y;
+    auto rx = std::round (fx);
+    auto ry = std::round (fy);
+
+    if (std::abs (fx - rx) > 1E-3 || std::abs (fy - ry) > 1E-3)
+    {
+      return false;
+    }
+
+    dx = static_cast<std::ptrdiff_t> (rx);
+    dy = static_cast<std::ptrdiff_t> (ry);
+    return true;
+  }
+
+  struct pan_stats
+  {
+    bool        reused        ; // false if it was a full render
+    std::size_t computed_bytes; // bitmap bytes that went through the kernel
+  };
+
+  namespace details
+  {
+    // Copies row py + dy of prev, moved dx pixels left, to row py of set.
+    //  Only the bytes [0, w) are written, pixels from outside prev are 0.
+    inline void shift_row (bitmap const & prev, bitmap & set, std::size_t py, std::ptrdiff_t dx, std::ptrdiff_t dy) noexcept
+    {
+      auto src    = prev.bits () + (static_cast<std::ptrdiff_t> (py) + dy)*static_cast<std::ptrdiff_t> (prev.w);
+      auto dst    = set.bits () + py*set.w;
+      auto w      = static_cast<std::ptrdiff_t> (set.w);
+      auto shift  = static_cast<unsigned> (((dx % 8) + 8) % 8);
+      auto skip   = (dx - static_cast<std::ptrdiff_t> (shift)) / 8;
+
+      auto byte_at = [src, w] (std::ptrdiff_t b) -> unsigned
+      {
+        return b >= 0 && b < w ? src[b] : 0U;
+      };
+
+      if (shift == 0)
+      {
+        for (auto b = std::ptrdiff_t (0); b < w; ++b)
+        {
+          dst[b] = static_cast<std::uint8_t> (byte_at (b + skip));
+        }
+        return;
+      }
+
+      // Bits are MSB first so moving pixels left shifts bytes left
+      for (auto b = std::ptrdiff_t (0); b < w; ++b)
+      {
+        auto hi = byte_at (b + skip);
+        auto lo = byte_at (b + skip + 1);
+        dst[b]  = static_cast<std::uint8_t> ((hi << shift) | (lo >> (8 - shift)));
+      }
+    }
+
+    template<typename kernel>
+    pan_stats compute_pan (kernel const & k, view const & v, bitmap const & prev, std::ptrdiff_t dx, std::ptrdiff_t dy, bitmap & set, block_kind, schedule sched)
+    {
+      auto sy = static_cast<std::ptrdiff_t> (v.y);
+      auto sx = static_cast<std::ptrdiff_t> (v.x);
+
+      // Rows [y0, y1) and columns [x0, x1) are in prev
+      auto y0 = static_cast<std::size_t> (std::min (sy, std::max (std::ptrdiff_t (0), -dy)));
+      auto y1 = static_cast<std::size_t> (std::max (std::ptrdiff_t (0), std::min (sy, sy - dy)));
+      auto x0 = static_cast<std::size_t> (std::min (sx, std::max (std::ptrdiff_t (0), -dx)));
+      auto x1 = static_cast<std::size_t> (std::max (std::ptrdiff_t (0), std::min (sx, sx - dx)));
+
+      // Exposed columns, rounded out to whole bytes. A pan only exposes one
+      //  side so only one of these is non-empty.
+      auto left   = (x0 + 7) / 8;
+      auto right  = x1 / 8;
+
+      auto groups = (v.y + kernel::rows - 1) / kernel::rows;
+      std::atomic<std::size_t> computed (0);
+
+      for_each_block (groups, 1, sched, [&] (std::size_t g)
+      {
+        auto y    = g*kernel::rows;
+        auto end  = std::min (y + kernel::rows, v.y);
+
+        if (y < y0 || end > y1)
+        {
+          compute_rows (k, v, set, y);
+          computed.fetch_add ((end - y)*set.w, std::memory_order_relaxed);
+          return;
+        }
+
+        for (auto py = y; py < end; ++py)
+        {
+          shift_row (prev, set, py, dx, dy);
+        }
+
+        if (left > 0)
+        {
+          compute_bytes (k, set, y, 0, left);
+        }
+
+        if (right < set.w)
+        {
+          compute_bytes (k, set, y, right, set.w);
+        }
+
+        computed.fetch_add ((end - y)*(left + set.w - right), std::memory_order_relaxed);
+      });
+
+      return pan_stats { true, computed.load () };
+    }
+
+    // The precise pass of a hybrid kernel is a block kernel
+    template<typename kernel>
+    pan_stats compute_pan (kernel const & k, view const & v, bitmap const & prev, std::ptrdiff_t dx, std::ptrdiff_t dy, bitmap & set, hybrid_kind, schedule sched)
+    {
+      return compute_pan (k, v, prev, dx, dy, set, block_kind {}, sched);
+    }
+
+    // Only block kernels compute byte ranges, the others render in full
+    template<typename kernel, typename kind>
+    pan_stats compute_pan (kernel const & k, view const & v, bitmap const &, std::ptrdiff_t, std::ptrdiff_t, bitmap & set, kind, schedule sched)
+    {
+      compute_set (k, v, set, kind {}, sched);
+      return pan_stats { false, set.sz };
+    }
+  }
+
+  // Renders v into set, reusing prev, a render of pv, if v is pv panned by
+  //  whole pixels. Falls back to a full render otherwise. set must not be
+  //  prev.
+  template<typename kernel>
+  pan_stats compute_pan (view const & pv, bitmap const & prev, view const & v, schedule sched, bitmap & set)
+  {
+    assert (set.x == v.x && set.y == v.y);
+    assert (&prev != &set);
+
+    auto k  = kernel (v);
+
+    std::ptrdiff_t dx;
+    std::ptrdiff_t dy;
+    auto overlaps = [&v] (std::ptrdiff_t dx, std::ptrdiff_t dy)
+    {
+      return std::abs (dx) < static_cast<std::ptrdiff_t> (v.x) && std::abs (dy) < static_cast<std::ptrdiff_t> (v.y);
+    };
+
+    if (prev.x != v.x || prev.y != v.y || !pan_offset (pv, v, dx, dy) || !overlaps (dx, dy))
+    {
+      details::compute_set (k, v, set, typename kernel::kind {}, sched);
+      return pan_stats { false, set.sz };
+    }
+
+    return details::compute_pan (k, v, prev, dx, dy, set, typename kernel::kind {}, sched);
+  }
+
+  namespace details
+  {
+    template<typename T, typename = void>
+    struct has_advance : std::false_type {};
+
+    template<typename T>
+    struct has_advance<T, decltype (std::declval<T const &> ().advance (nullptr, nullptr, nullptr, nullptr, 0U), void ())>
+      : std::true_type {};
+
+    // The orbits of the pixels inside of a band of rows, pixel is the index
+    //  in the band, (y - first y)*v.x + x
+    struct orbits
+    {
+      std::vector<std::uint32_t>  pixel ;
+      std::vector<double>         x     ;
+      std::vector<double>         y     ;
+    };
+  }
+
+  // A render that keeps the orbits of its pixels still inside, 20 bytes
+  //  each. A deeper render then only continues them from where they stopped
+  //  instead of starting over, the pixels that escaped stay outside at any
+  //  max_iter and the pixels in the main cardioid or the period 2 bulb stay
+  //  inside. The orbits are kept per band of rows so a band is deepened on
+  //  one thread, as its rows are rendered. The orbits are continued with
+  //  the kernel's advance.
+  template<typename kernel>
+  struct render_session
+  {
+    static_assert (details::has_advance<kernel>::value, "A render session continues orbits with advance");
+
+    // Renders v
+    render_session (view const & v, schedule sched = schedule::guided)
+      : v     (v)
+      , sched (sched)
+      , bits  (create_bitmap (v.x, v.y))
+      , bands ((v.y + cyclic_band_rows - 1) / cyclic_band_rows)
+    {
+      auto k = kernel (v);
+
+      details::for_each_block (bands.size (), 1, sched, [this, &k] (std::size_t band)
+      {
+        auto & o  = bands[band];
+        auto y0   = band*cyclic_band_rows;
+        auto end  = std::min<std::size_t> (y0 + cyclic_band_rows, this->v.y);
+
+        for (auto py = y0; py < end; ++py)
+        {
+          auto row = bits->bits () + py*bits->w;
+
+          // Only the pixels in the disk can be inside, as in compute_rows
+          std::size_t b0;
+          std::size_t b1;
+          details::disk_bytes (this->v, 1, py, b0, b1);
+
+          std::memset (row, 0, b0);
+          std::memset (row + b1, 0, bits->w - b1);
+
+          for (auto px = b0*8; px < b1*8; px += query_group)
+          {
+            auto n = std::min (query_group, b1*8 - px);
+
+            // Slot i holds pixel i with the bits of a byte reversed so the
+            //  mask of a byte is the byte. The kernels start at z = c.
+            alignas (32) double cx[query_group];
+            alignas (32) double cy[query_group];
+            alignas (32) double x[query_group];
+            alignas (32) double y[query_group];
+            for (auto i = 0U; i < query_group; ++i)
+            {
+              auto p  = px + (i & ~7U) + 7 - (i & 7U);
+              cx[i]   = i < n ? this->v.min_x + p*this->v.scale_x : 4.0;
+              cy[i]   = i < n ? this->v.scale_y*py + this->v.min_y : 4.0;
+              x[i]    = cx[i];
+              y[i]    = cy[i];
+            }
+
+            auto alive = k.advance (cx, cy, x, y, this->v.max_iter);
+
+            for (auto b = 0U; b*8 < n; ++b)
+            {
+              row[px/8 + b] = static_cast<std::uint8_t> (alive >> 8*b);
+            }
+
+            // Pixels in the bulbs never escape, they need no orbit
+            for (auto i = 0U; alive != 0; ++i, alive >>= 1)
+            {
+              if ((alive & 1U) && !details::in_bulbs (cx[i], cy[i]))
+              {
+                o.pixel.push_back (static_cast<std::uint32_t> ((py - y0)*this->v.x + px + (i & ~7U) + 7 - (i & 7U)));
+                o.x.push_back (x[i]);
+                o.y.push_back (y[i]);
+              }
+            }
+          }
+        }
+      });
+    }
+
+    // Continues the orbits up to max_iter steps in all, the set is then the
+    //  render of the view at max_iter. A max_iter below the current one is
+    //  ignored, the escaped pixels are gone.
+    void deepen (std::uint32_t max_iter)
+    {
+      if (max_iter <= v.max_iter)
+      {
+        return;
+      }
+
+      auto k      = kernel (v);
+      auto steps  = max_iter - v.max_iter;
+
+      details::for_each_block (bands.size (), 1, sched, [this, &k, steps] (std::size_t band)
+      {
+        auto & o    = bands[band];
+        auto rows   = bits->bits () + band*cyclic_band_rows*bits->w;
+        auto n      = o.pixel.size ();
+        auto kept   = std::size_t (0);
+
+        for (auto g = std::size_t (0); g < n; g += query_group)
+        {
+          auto m = std::min (query_group, n - g);
+
+          alignas (32) double cx[query_group];
+          alignas (32) double cy[query_group];
+          alignas (32) double x[query_group];
+          alignas (32) double y[query_group];
+          for (auto i = 0U; i < query_group; ++i)
+          {
+            auto p  = i < m ? o.pixel[g + i] : 0U;
+            cx[i]   = i < m ? v.min_x + (p % v.x)*v.scale_x : 4.0;
+            cy[i]   = i < m ? v.scale_y*(band*cyclic_band_rows + p / v.x) + v.min_y : 4.0;
+            x[i]    = i < m ? o.x[g + i] : 4.0;
+            y[i]    = i < m ? o.y[g + i] : 4.0;
+          }
+
+          auto alive = k.advance (cx, cy, x, y, steps);
+
+          // The group is copied out so the orbits left can be moved down in
+          //  place, in pixel order
+          for (auto i = 0U; i < m; ++i)
+          {
+            auto p = o.pixel[g + i];
+            if ((alive >> i) & 1U)
+            {
+              o.pixel[kept] = p;
+              o.x[kept]     = x[i];
+              o.y[kept]     = y[i];
+              ++kept;
+            }
+            else
+            {
+              auto px = p % v.x;
+              rows[(p / v.x)*bits->w + px/8] &= static_cast<std::uint8_t> (~(0x80U >> (px % 8)));
+            }
+          }
+        }
+
+        o.pixel.resize (kept);
+        o.x.resize (kept);
+        o.y.resize (kept);
+      });
+
+      v.max_iter = max_iter;
+    }
+
+    // The view rendered, max_iter is the current one
+    view const & current () const noexcept
+    {
+      return v;
+    }
+
+    bitmap const & set () const noexcept
+    {
+      return *bits;
+    }
+
+    // Pixels inside at the current max_iter that may still escape
+    std::size_t unresolved () const noexcept
+    {
+      auto n = std::size_t (0);
+      for (auto & o : bands)
+      {
+        n += o.pixel.size ();
+      }
+      return n;
+    }
+
+  private:
+    view                          v     ;
+    schedule                      sched ;
+    bitmap::uptr                  bits  ;
+    std::vector<details::orbits>  bands ;
+  };
+
+  // Buddhabrot
+  //  The density of the orbits escaping within max_iter. Points c are sampled
+  //  over the square around the disk of radius 2 and their escape counts
+  //  found a query_group at a time, then the escaping ones are gathered into
+  //  groups and traced again. Every position an orbit visits before it
+  //  escapes is a hit on the pixel of v it falls in.
+  //
+  //  Each worker samples its share of the points with its own random stream
+  //  into its own histogram, tiles of density_tile_dim*density_tile_dim
+  //  counters allocated on their first hit, so no counter is ever shared.
+  //  The histograms are summed at the end.
+  //
+  //  sampling::importance probes density_cells*density_cells cells of the
+  //  square first and only samples the cells where a probe escapes after
+  //  density_late steps or more. Cells inside the set never escape and cells
+  //  that escape at once only add orbits of a few steps, skipping them
+  //  trades a bias for many more long orbits per sample. The skipped cells
+  //  are never sampled so no weight can undo it, the density is not that of
+  //  sampling::uniform, the default.
+
+  constexpr double        density_extent    = 2.0;
+  constexpr std::size_t   density_tile_dim  = 64;
+  constexpr std::size_t   density_cells     = 256;
+  constexpr std::uint32_t density_late      = 8;
+  // Orbits are traced this many steps at a time
+  constexpr std::uint32_t density_trace     = 256;
+
+  enum class sampling
+  {
+    uniform   , // over the whole square
+    importance, // over the cells a coarse pass found on the boundary
+  };
+
+  inline char const * sampling_name (sampling how) noexcept
+  {
+    return how == sampling::importance ? "importance" : "uniform";
+  }
+
+  struct density
+  {
+    std::size_t                 x       ;
+    std::size_t                 y       ;
+    std::vector<std::uint32_t>  hits    ; // row by row
+    std::uint64_t               samples ;
+    std::uint64_t               orbits  ; // samples that escaped and were traced
+    std::uint64_t               cells   ; // cells sampled, of density_cells*density_cells
+  };
+
+  namespace details
+  {
+    // The escape count of the reference's scalar loop
+    inline std::uint32_t scalar_count (double cx, double cy, std::uint32_t max_iter) noexcept
+    {
+      auto x = cx;
+      auto y = cy;
+      for (auto iter = 0U; iter < max_iter; ++iter)
+      {
+        auto x2 = x*x;
+        auto y2 = y*y;
+        if (x2 + y2 > 4)
+        {
+          return iter;
+        }
+        y = 2*x*y   + cy;
+        x = x2 - y2 + cx;
+      }
+
+      return max_iter;
+    }
+
+    template<typename T, typename = void>
+    struct has_trace : std::false_type {};
+
+    template<typename T>
+    struct has_trace<T, decltype (std::declval<T const &> ().trace (nullptr, nullptr, nullptr, nullptr, 0U, nullptr, nullptr), void ())>
+      : std::true_type {};
+
+    template<typename kernel>
+    void group_counts (kernel const & k, double const * cx, double const * cy, std::uint32_t, std::uint32_t * counts, std::true_type)
+    {
+      k.query_counts (cx, cy, counts);
+    }
+
+    template<typename kernel>
+    void group_counts (kernel const &, double const * cx, double const * cy, std::uint32_t max_iter, std::uint32_t * counts, std::false_type)
+    {
+      for (auto i = 0U; i < query_group; ++i)
+      {
+        counts[i] = scalar_count (cx[i], cy[i], max_iter);
+      }
+    }
+
+    template<typename kernel>
+    void trace (kernel const & k, double const * cx, double const * cy, double * x, double * y, std::uint32_t steps, double * tx, double * ty, std::true_type)
+    {
+      k.trace (cx, cy, x, y, steps, tx, ty);
+    }
+
+    template<typename kernel>
+    void trace (kernel const &, double const * cx, double const * cy, double * x, double * y, std::uint32_t steps, double * tx, double * ty, std::false_type)
+    {
+      for (auto i = 0U; i < query_group; ++i)
+      {
+        auto zx = x[i];
+        auto zy = y[i];
+        for (auto s = 0U; s < steps; ++s)
+        {
+          tx[s*query_group + i] = zx;
+          ty[s*query_group + i] = zy;
+
+          auto x2 = zx*zx;
+          auto y2 = zy*zy;
+          zy      = 2*zx*zy + cy[i];
+          zx      = x2 - y2 + cx[i];
+        }
+        x[i] = zx;
+        y[i] = zy;
+      }
+    }
+
+    // The hits of one worker, tiles are allocated on their first hit
+    struct density_histogram
+    {
+      explicit density_histogram (view const & v)
+        : v       (v)
+        , tiles_x ((v.x + density_tile_dim - 1) / density_tile_dim)
+        , tiles   (tiles_x*((v.y + density_tile_dim - 1) / density_tile_dim))
+      {
+      }
+
+      void hit (double x, double y)
+      {
+        auto fx = std::floor ((x - v.min_x) / v.scale_x + 0.5);
+        auto fy = std::floor ((y - v.min_y) / v.scale_y + 0.5);
+        if (fx < 0 || fy < 0 || fx >= v.x || fy >= v.y)
+        {
+          return;
+        }
+
+        auto px = static_cast<std::size_t> (fx);
+        auto py = static_cast<std::size_t> (fy);
+
+        auto & t = tiles[(py / density_tile_dim)*tiles_x + px / density_tile_dim];
+        if (!t)
+        {
+          t = std::make_unique<std::uint32_t[]> (density_tile_dim*density_tile_dim);
+        }
+        ++t[(py % density_tile_dim)*density_tile_dim + px % density_tile_dim];
+      }
+
+      // Adds the hits to the row by row hits of v
+      void add_to (std::uint32_t * hits) const
+      {
+        for (auto i = 0U; i < tiles.size (); ++i)
+        {
+          if (!tiles[i])
+          {
+            continue;
+          }
+
+          auto x0 = (i % tiles_x)*density_tile_dim;
+          auto y0 = (i / tiles_x)*density_tile_dim;
+          auto w  = std::min (density_tile_dim, v.x - x0);
+          auto h  = std::min (density_tile_dim, v.y - y0);
+          for (auto r = 0U; r < h; ++r)
+          {
+            auto from = tiles[i].get () + r*density_tile_dim;
+            auto to   = hits + (y0 + r)*v.x + x0;
+            for (auto c = 0U; c < w; ++c)
+            {
+              to[c] += from[c];
+            }
+          }
+        }
+      }
+
+      view                                          v       ;
+      std::size_t                                   tiles_x ;
+      std::vector<std::unique_ptr<std::uint32_t[]>> tiles   ;
+    };
+
+    // Escaping points waiting to be traced, a query_group at a time
+    template<typename kernel>
+    struct orbit_tracer
+    {
+      orbit_tracer (kernel const & k, density_histogram & histogram)
+        : k         (k)
+        , histogram (histogram)
+        , n         (0)
+        , tx        (density_trace*query_group)
+        , ty        (density_trace*query_group)
+      {
+      }
+
+      void add (double x, double y, std::uint32_t count)
+      {
+        cx[n]     = x;
+        cy[n]     = y;
+        counts[n] = count;
+        if (++n == query_group)
+        {
+          flush ();
+        }
+      }
+
+      // Traces the points waiting, the group is padded with points that
+      //  escape at once
+      void flush ()
+      {
+        if (n == 0)
+        {
+          return;
+        }
+
+        auto steps = 0U;
+        for (auto i = 0U; i < query_group; ++i)
+        {
+          if (i >= n)
+          {
+            cx[i]     = 4.0;
+            cy[i]     = 4.0;
+            counts[i] = 0;
+          }
+          x[i]  = cx[i];
+          y[i]  = cy[i];
+          steps = std::max (steps, counts[i]);
+        }
+
+        for (auto s0 = 0U; s0 < steps; s0 += density_trace)
+        {
+          auto len = std::min (density_trace, steps - s0);
+          details::trace (k, cx, cy, x, y, len, tx.data (), ty.data (), has_trace<kernel> {});
+
+          // Orbits near the boundary are chaotic, rounded differently by
+          //  the trace they may escape long before their count. A lane stops
+          //  at the first position outside the disk of radius 2.
+          for (auto i = 0U; i < n; ++i)
+          {
+            auto end = std::min (len, counts[i] > s0 ? counts[i] - s0 : 0U);
+            for (auto s = 0U; s < end; ++s)
+            {
+              auto zx = tx[s*query_group + i];
+              auto zy = ty[s*query_group + i];
+              if (!(zx*zx + zy*zy <= 4.0))
+              {
+                counts[i] = s0 + s;
+                break;
+              }
+              histogram.hit (zx, zy);
+            }
+          }
+        }
+
+        n = 0;
+      }
+
+      kernel const &        k                 ;
+      density_histogram &   histogram         ;
+      std::size_t           n                 ;
+      std::vector<double>   tx                ;
+      std::vector<double>   ty                ;
+      alignas (32) double   cx[query_group]   ;
+      alignas (32) double   cy[query_group]   ;
+      alignas (32) double   x[query_group]    ;
+      alignas (32) double   y[query_group]    ;
+      std::uint32_t         counts[query_group];
+    };
+
+    // The cells of the square to sample, all of them or those where a probe
+    //  escapes late. Probes sit on the corners and the centre of the cells.
+    template<typename kernel>
+    std::vector<std::uint32_t> density_cells_to_sample (kernel const & k, std::uint32_t max_iter, sampling how, schedule sched)
+    {
+      std::vector<std::uint32_t> cells;
+
+      if (how == sampling::uniform)
+      {
+        cells.resize (density_cells*density_cells);
+        for (auto i = 0U; i < cells.size (); ++i)
+        {
+          cells[i] = i;
+        }
+        return cells;
+      }
+
+      // The probes of row r are at y = -extent + r*step
+      auto probes = 2*density_cells + 1;
+      auto step   = density_extent / density_cells;
+      std::vector<std::uint32_t> counts (probes*probes);
+
+      for_each_block (probes, 1, sched, [&] (std::size_t r)
+      {
+        alignas (32) double cx[query_group];
+        alignas (32) double cy[query_group];
+        std::uint32_t       group[query_group];
+
+        for (auto first = std::size_t (0); first < probes; first += query_group)
+        {
+          for (auto i = 0U; i < query_group; ++i)
+          {
+            cx[i] = -density_extent + (first + i)*step;
+            cy[i] = -density_extent + r*step;
+          }
+          group_counts (k, cx, cy, max_iter, group, has_query_counts<kernel> {});
+          std::copy (group, group + std::min (query_group, probes - first), counts.begin () + r*probes + first);
+        }
+      });
+
+      for (auto cy = 0U; cy < density_cells; ++cy)
+      {
+        for (auto cx = 0U; cx < density_cells; ++cx)
+        {
+          auto late = false;
+          for (auto r = 2*cy; r <= 2*cy + 2; ++r)
+          {
+            for (auto c = 2*cx; c <= 2*cx + 2; ++c)
+            {
+              auto n  = counts[r*probes + c];
+              late    = late || (n >= density_late && n < max_iter);
+            }
+          }
+
+          if (late)
+          {
+            cells.push_back (static_cast<std::uint32_t> (cy*density_cells + cx));
+          }
+        }
+      }
+
+      // Too shallow for any probe to escape late
+      if (cells.empty ())
+      {
+        return density_cells_to_sample (k, max_iter, sampling::uniform, sched);
+      }
+
+      return cells;
+    }
+
+    inline std::size_t schedule_workers (schedule sched)
+    {
+      switch (sched)
+      {
+      case schedule::serial:
+        return 1;
+      case schedule::cyclic:
+        return shared_pool ().size ();
+      case schedule::guided:
+        break;
+      }
+#ifdef _OPENMP
+      return static_cast<std::size_t> (omp_get_max_threads ());
+#else
+      return 1;
+#endif
+    }
+  }
+
+  // Samples samples points and counts the hits of the escaping orbits on
+  //  the pixels of v. v.max_iter bounds the orbits.
+  template<typename kernel>
+  density compute_density (view const & v, std::uint64_t samples, sampling how, schedule sched = schedule::guided)
+  {
+    auto k        = kernel (make_view (query_group, v.max_iter));
+    auto cells    = details::density_cells_to_sample (k, v.max_iter, how, sched);
+    auto workers  = details::schedule_workers (sched);
+    auto cell     = 2*density_extent / density_cells;
+
+    std::vector<details::density_histogram> histograms;
+    for (auto w = 0U; w < workers; ++w)
+    {
+      histograms.emplace_back (v);
+    }
+    std::atomic<std::uint64_t> orbits (0);
+
+    details::for_each_block (workers, 1, sched, [&] (std::size_t w)
+    {
+      auto share  = samples / workers + (w < samples % workers ? 1 : 0);
+      auto tracer = details::orbit_tracer<kernel> (k, histograms[w]);
+      auto traced = std::uint64_t (0);
+
+      std::mt19937_64 random (19740531 + w);
+      std::uniform_int_distribution<std::size_t>  random_cell (0, cells.size () - 1);
+      std::uniform_real_distribution<double>      random_offset (0.0, cell);
+
+      alignas (32) double cx[query_group];
+      alignas (32) double cy[query_group];
+      std::uint32_t       counts[query_group];
+
+      for (auto first = std::uint64_t (0); first < share; first += query_group)
+      {
+        for (auto i = 0U; i < query_group; ++i)
+        {
+          auto c  = cells[random_cell (random)];
+          cx[i]   = -density_extent + (c % density_cells)*cell + random_offset (random);
+          cy[i]   = -density_extent + (c / density_cells)*cell + random_offset (random);
+        }
+
+        details::group_counts (k, cx, cy, v.max_iter, counts, details::has_query_counts<kernel> {});
+
+        auto left = std::min<std::uint64_t> (query_group, share - first);
+        for (auto i = 0U; i < left; ++i)
+        {
+          if (counts[i] < v.max_iter)
+          {
+            tracer.add (cx[i], cy[i], counts[i]);
+            ++traced;
+          }
+        }
+      }
+
+      tracer.flush ();
+      orbits.fetch_add (traced, std::memory_order_relaxed);
+    });
+
+    auto d    = density {};
+    d.x       = v.x;
+    d.y       = v.y;
+    d.hits.resize (v.x*v.y);
+    d.samples = samples;
+    d.orbits  = orbits.load ();
+    d.cells   = cells.size ();
+
+    for (auto & histogram : histograms)
+    {
+      histogram.add_to (d.hits.data ());
+    }
+
+    return d;
+  }
+
+  // Shades the hits into a greymap, white at the most hit pixel. The square
+  //  root brings out the faint orbits.
+  inline greymap::uptr shade_density (density const & d)
+  {
+    auto grey   = std::make_unique<greymap> (d.x, d.y);
+    auto most   = d.hits.empty () ? 0U : *std::max_element (d.hits.begin (), d.hits.end ());
+    auto pixels = grey->pixels ();
+
+    for (auto i = 0U; i < d.hits.size (); ++i)
+    {
+      pixels[i] = most > 0 ? static_cast<std::uint8_t> (255.0*std::sqrt (static_cast<double> (d.hits[i]) / most)) : 0;
+    }
+
+    return grey;
+  }
+}
@@ -0,0 +1,1633 @@
+// ----------------------------------------------------------------------------------------------
+// Copyright 2017 Mårten Rånge
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------------------------
+
+// The parts shared by all C++ mandelbrot variants: timing, output, the
+//  modes and main. A variant only supplies kernel policies, see
+//  kernel_drivers.hpp, and calls mandel::run from main.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#ifdef _MSVC_LANG
+# include <fcntl.h>
+# include <io.h>
+# include <sys/stat.h>
+# define MANDEL_PRINTF(f, a)
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# define MANDEL_PRINTF(f, a) __attribute__ ((format (printf, f, a)))
+#endif
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include "bitmap_layouts.hpp"
+#include "bitmap_pool.hpp"
+#include "command_line.hpp"
+#include "formula_jit.hpp"
+#include "kernel_drivers.hpp"
+#include "worker_pool.hpp"
+
+namespace mandel
+{
+  // The default view of the bandwidth benchmark, the disk of radius 2 the
+  //  set lies in covers 0.3% of it
+  constexpr auto    bandwidth_extent  = 32.0;
+  constexpr auto    bandwidth_dim     = 16000U;
+
+  // The defaults of buddhabrot mode, the view holds the whole density
+  constexpr auto    buddhabrot_iter     = 1000U;
+  constexpr auto    buddhabrot_samples  = 10000000U;
+
+  // Renders up to this many pixels default to the serial schedule, for them
+  //  starting threads costs more than it saves
+  constexpr auto    tiny_pixels = 256U*256U;
+
+  template<typename T>
+  auto time_it (T a)
+  {
+    auto before = std::chrono::high_resolution_clock::now ();
+    auto result = a ();
+    auto after  = std::chrono::high_resolution_clock::now ();
+    auto diff   = std::chrono::duration_cast<std::chrono::milliseconds> (after - before).count ();
+    return std::make_tuple (diff, std::move (result));
+  }
+
+  namespace details
+  {
+    inline bool write_all (int fd, std::uint8_t const * p, std::size_t size) noexcept
+    {
+      // Writes may be short on pipes, continue after the written bytes
+      while (size > 0)
+      {
+#ifdef _MSVC_LANG
+        auto written = _write (fd, p, static_cast<unsigned> (std::min<std::size_t> (size, 1U << 30)));
+#else
+        auto written = write (fd, p, size);
+#endif
+        if (written <= 0)
+        {
+          return false;
+        }
+
+        p     += written;
+        size  -= static_cast<std::size_t> (written);
+      }
+
+      return true;
+    }
+  }
+
+  namespace details
+  {
+    // Creates path and writes it with write (fd)
+    template<typename F>
+    bool write_file_with (char const * path, F const & write)
+    {
+#ifdef _MSVC_LANG
+      auto fd = _open (path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+      auto fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+      if (fd < 0)
+      {
+        return false;
+      }
+
+      auto result = write (fd);
+
+#ifdef _MSVC_LANG
+      return _close (fd) == 0 && result;
+#else
+      return close (fd) == 0 && result;
+#endif
+    }
+
+    template<typename F>
+    bool write_stdout_with (F const & write)
+    {
+#ifdef _MSVC_LANG
+      std::fflush (stdout);
+      _setmode (_fileno (stdout), _O_BINARY);
+      return write (_fileno (stdout));
+#else
+      return write (STDOUT_FILENO);
+#endif
+    }
+
+    inline bool write_file (char const * path, std::uint8_t const * p, std::size_t size)
+    {
+      return write_file_with (path, [p, size] (int fd) { return write_all (fd, p, size); });
+    }
+
+    inline bool write_stdout (std::uint8_t const * p, std::size_t size)
+    {
+      return write_stdout_with ([p, size] (int fd) { return write_all (fd, p, size); });
+    }
+
+    // Streams tiles as a PBM file, the rows of a band of tiles are gathered
+    //  into a buffer of tile_dim rows and written with one write
+    inline bool write_tiled (int fd, tiled_bitmap const & tiles)
+    {
+      char header[64];
+      auto hsz = std::snprintf (header, sizeof header, "P4\n%zu %zu\n", tiles.x, tiles.y);
+      if (!write_all (fd, reinterpret_cast<std::uint8_t const *> (header), static_cast<std::size_t> (hsz)))
+      {
+        return false;
+      }
+
+      std::vector<std::uint8_t> band (tile_dim*tiles.w);
+      for (auto ty = 0U; ty < tiles.tiles_y; ++ty)
+      {
+        tiles.copy_band (ty, band.data ());
+
+        auto rows = std::min (tile_dim, tiles.y - ty*tile_dim);
+        if (!write_all (fd, band.data (), rows*tiles.w))
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+  }
+
+  // Writes the PBM file with a single write
+  inline bool write_pbm (char const * path, bitmap const & set)
+  {
+    return details::write_file (path, set.pbm (), set.pbm_size ());
+  }
+
+  // Writes the PBM file to stdout with a single write
+  inline bool write_pbm_stdout (bitmap const & set)
+  {
+    return details::write_stdout (set.pbm (), set.pbm_size ());
+  }
+
+  // Writes the PBM file of tiles a band of tiles at a time, with no row
+  //  major copy of the whole bitmap
+  inline bool write_pbm (char const * path, tiled_bitmap const & tiles)
+  {
+    return details::write_file_with (path, [&tiles] (int fd) { return details::write_tiled (fd, tiles); });
+  }
+
+  inline bool write_pbm_stdout (tiled_bitmap const & tiles)
+  {
+    return details::write_stdout_with ([&tiles] (int fd) { return details::write_tiled (fd, tiles); });
+  }
+
+  // Limits the guided and cyclic schedules to threads threads, 0 for one
+  //  per CPU. Call before the first render, the worker pool keeps its size.
+  inline void set_threads (std::size_t threads)
+  {
+    shared_pool_limit () = threads;
+#ifdef _OPENMP
+    if (threads > 0)
+    {
+      omp_set_num_threads (static_cast<int> (threads));
+    }
+#endif
+  }
+
+  // Writes the PGM file with a single write
+  inline bool write_pgm (char const * path, greymap const & grey)
+  {
+    return details::write_file (path, grey.pgm (), grey.pgm_size ());
+  }
+
+  // Exit codes of run besides 0
+  constexpr int exit_usage    = 2; // invalid settings, or a kernel that can't do what was asked
+  constexpr int exit_io       = 3; // the job file couldn't be opened or an image couldn't be written
+  constexpr int exit_mismatch = 4; // renders that must be identical differ
+
+  struct options
+  {
+    char const *  program   ;
+    mode          what      ;
+    view          v         ;
+    schedule      sched     ;
+    bool          auto_sched; // no schedule was asked for, batch picks one per job
+    char const *  output    ; // path, "-" for stdout or nullptr for <program>.pbm or .pgm
+    format        fmt       ;
+    bitmap_layout layout    ;
+    char const *  jobs      ; // batch job file, "-" or nullptr for stdin
+    std::size_t   points    ; // query points
+    std::FILE *   log       ; // progress messages, stderr when pixels go to stdout
+
+    std::vector<std::uint32_t> levels; // render one bitmap per limit instead of at v.max_iter
+
+    std::uint64_t samples   ; // buddhabrot points
+    sampling      how       ;
+  };
+
+  // A render of batch mode
+  struct job
+  {
+    view        v     ;
+    std::string output; // path or "-" for stdout
+  };
+
+  // Reads one job per line:
+  //    min_x min_y max_x max_y width height max_iter output
+  //  Blank lines and lines starting with # are skipped. Output paths can't
+  //  contain whitespace.
+  inline bool read_jobs (std::FILE * file, std::vector<job> & jobs, std::FILE * log)
+  {
+    char line[4096];
+    char output[4096];
+
+    for (auto line_no = 1U; std::fgets (line, sizeof line, file); ++line_no)
+    {
+      auto p = line;
+      while (*p == ' ' || *p == '\t')
+      {
+        ++p;
+      }
+
+      if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+      {
+        continue;
+      }
+
+      double        x0, y0, x1, y1;
+      unsigned long width, height, iter;
+
+      auto fields = std::sscanf (
+          p
+        , "%lf %lf %lf %lf %lu %lu %lu %4095s"
+        , &x0
+        , &y0
+        , &x1
+        , &y1
+        , &width
+        , &height
+        , &iter
+        , output
+        );
+
+      if (fields != 8)
+      {
+        std::fprintf (log, "Line %u: expected min_x min_y max_x max_y width height max_iter output\n", line_no);
+        return false;
+      }
+
+      if (!(x0 < x1 && y0 < y1))
+      {
+        std::fprintf (log, "Line %u: the viewport is empty\n", line_no);
+        return false;
+      }
+
+      if (width == 0 || height == 0 || width % 8 != 0)
+      {
+        std::fprintf (log, "Line %u: width must be a positive multiple of 8 and height positive\n", line_no);
+        return false;
+      }
+
+      if (iter == 0 || iter > UINT32_MAX)
+      {
+        std::fprintf (log, "Line %u: max_iter must be positive\n", line_no);
+        return false;
+      }
+
+      jobs.push_back (job { make_view (x0, y0, x1, y1, width, height, static_cast<std::uint32_t> (iter)), output });
+    }
+
+    return true;
+  }
+
+  // Writes rendered bitmaps on its own thread so the output of one job
+  //  overlaps the compute of the next. Written bitmaps go back to their pool.
+  struct pbm_writer
+  {
+    explicit pbm_writer (std::FILE * log)
+      : log           (log)
+      , queued_output (nullptr)
+      , writing       (false)
+      , stop          (false)
+      , failed        (false)
+    {
+      thread = std::thread ([this] { work (); });
+    }
+
+    ~pbm_writer () noexcept
+    {
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        stop = true;
+      }
+      changed.notify_all ();
+      thread.join ();
+    }
+
+    pbm_writer (pbm_writer const &)             = delete;
+    pbm_writer& operator= (pbm_writer const &)  = delete;
+
+    // Queues set for writing, waits while an earlier bitmap is still queued
+    void push (bitmap::uptr set, char const * output)
+    {
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        changed.wait (lock, [this] { return !queued; });
+        queued        = std::move (set);
+        queued_output = output;
+      }
+      changed.notify_all ();
+    }
+
+    // Waits for queued bitmaps to be written, false if any write failed
+    bool finish ()
+    {
+      std::unique_lock<std::mutex> lock (mutex);
+      changed.wait (lock, [this] { return !queued && !writing; });
+      return !failed;
+    }
+
+  private:
+    void work ()
+    {
+      for (;;)
+      {
+        bitmap::uptr set;
+        char const * output;
+
+        {
+          std::unique_lock<std::mutex> lock (mutex);
+          changed.wait (lock, [this] { return queued || stop; });
+          if (!queued)
+          {
+            return;
+          }
+          set     = std::move (queued);
+          output  = queued_output;
+          writing = true;
+        }
+        changed.notify_all ();
+
+        auto ok = std::strcmp (output, "-") == 0
+          ? write_pbm_stdout (*set)
+          : write_pbm (output, *set)
+          ;
+
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+          if (!ok)
+          {
+            std::fprintf (log, "Failed to write %s\n", output);
+            failed = true;
+          }
+          writing = false;
+        }
+        changed.notify_all ();
+      }
+    }
+
+    std::FILE *               log           ;
+    std::mutex                mutex         ;
+    std::condition_variable   changed       ;
+    bitmap::uptr              queued        ;
+    char const *              queued_output ;
+    bool                      writing       ;
+    bool                      stop          ;
+    bool                      failed        ;
+    std::thread               thread        ;
+  };
+
+  namespace details
+  {
+    inline void print_pool_stats (std::FILE * log)
+    {
+      auto stats = shared_bitmap_pool ().stats ();
+      std::fprintf (
+          log
+        , "  bitmap pool %llu acquires, %llu hits, %llu dropped, %.1f MB peak\n"
+        , static_cast<unsigned long long> (stats.acquires)
+        , static_cast<unsigned long long> (stats.hits)
+        , static_cast<unsigned long long> (stats.dropped)
+        , stats.peak_bytes / (1024.0*1024.0)
+        );
+    }
+
+    // printf to a string
+    MANDEL_PRINTF (1, 2) inline std::string format_string (char const * format, ...)
+    {
+      va_list args;
+      va_start (args, format);
+      va_list again;
+      va_copy (again, args);
+      auto size = std::vsnprintf (nullptr, 0, format, args);
+      va_end (args);
+
+      std::string result (size > 0 ? static_cast<std::size_t> (size) : 0U, '\0');
+      std::vsnprintf (&result[0], result.size () + 1, format, again);
+      va_end (again);
+
+      return result;
+    }
+
+    // Every mode runs in this frame. Prints "<what> using <kernel>
+    //  (<sched>)<note>", sched nullptr for modes that pick their own, runs
+    //  body for the exit code and prints the bitmap pool stats if it
+    //  succeeded.
+    template<typename kernel, typename F>
+    int run_mode (std::FILE * log, std::string const & what, char const * sched, char const * note, F const & body)
+    {
+      if (sched)
+      {
+        std::fprintf (log, "%s using %s (%s)%s\n", what.c_str (), kernel::name (), sched, note);
+      }
+      else
+      {
+        std::fprintf (log, "%s using %s%s\n", what.c_str (), kernel::name (), note);
+      }
+
+      auto result = body ();
+      if (result == 0)
+      {
+        print_pool_stats (log);
+      }
+
+      return result;
+    }
+
+    template<typename kernel, typename F>
+    int run_mode (options const & opts, std::string const & what, char const * note, F const & body)
+    {
+      return run_mode<kernel> (opts.log, what, schedule_name (opts.sched), note, body);
+    }
+
+    template<typename kernel, typename F>
+    int run_mode (options const & opts, std::string const & what, F const & body)
+    {
+      return run_mode<kernel> (opts, what, "", body);
+    }
+
+    // Runs f, prints how long it took and returns what f returned
+    template<typename F>
+    auto timed (std::FILE * log, F const & f)
+    {
+      auto res = time_it (f);
+      std::fprintf (log, "  it took %lld ms\n", static_cast<long long> (std::get<0> (res)));
+      return std::move (std::get<1> (res));
+    }
+
+    // "mandelbrot set <x>x<y>(<max_iter>)"
+    inline std::string set_name (view const & v)
+    {
+      return format_string ("mandelbrot set %zux%zu(%u)", v.x, v.y, v.max_iter);
+    }
+
+    // "<set_name> over [min_x,max_x]x[min_y,max_y]"
+    inline std::string set_name_over (view const & v)
+    {
+      return set_name (v) + format_string (" over [%g,%g]x[%g,%g]", v.min_x, v.max_x, v.min_y, v.max_y);
+    }
+
+    // Writes the image to opts.output with write (fd), see options
+    template<typename F>
+    int write_output (options const & opts, F const & write)
+    {
+      if (opts.output && std::strcmp (opts.output, "-") == 0)
+      {
+        if (!write_stdout_with (write))
+        {
+          std::fprintf (opts.log, "Failed to write to stdout\n");
+          return exit_io;
+        }
+
+        return 0;
+      }
+
+      char path[256];
+      std::snprintf (path, sizeof path, "%s.%s", opts.program, opts.fmt == format::pgm ? "pgm" : "pbm");
+
+      auto output = opts.output ? opts.output : path;
+
+      if (!write_file_with (output, write))
+      {
+        std::fprintf (opts.log, "Failed to write %s\n", output);
+        return exit_io;
+      }
+
+      return 0;
+    }
+
+    // Writes the image in p to opts.output
+    inline int write_image (options const & opts, std::uint8_t const * p, std::size_t size)
+    {
+      return write_output (opts, [p, size] (int fd) { return write_all (fd, p, size); });
+    }
+
+    template<typename kernel>
+    int render_pgm (options const & opts, count_kind)
+    {
+      auto & v = opts.v;
+
+      return run_mode<kernel> (opts, format_string ("Generating escape counts %zux%zu(%u)", v.x, v.y, v.max_iter), [&opts]
+      {
+        auto grey = std::get<0> (timed (opts.log, [&opts] { return compute_greymap<kernel> (opts.v, opts.sched); }));
+        return write_image (opts, grey->pgm (), grey->pgm_size ());
+      });
+    }
+
+    template<typename kernel>
+    int render_pgm (options const & opts, block_kind)
+    {
+      auto & v = opts.v;
+
+      return run_mode<kernel> (opts, format_string ("Generating %zux%zu anti-aliased thumbnail(%u)", v.x, v.y, v.max_iter), [&opts]
+      {
+        auto grey = timed (opts.log, [&opts] { return compute_thumbnail<kernel> (opts.v, opts.sched); });
+        return write_image (opts, grey->pgm (), grey->pgm_size ());
+      });
+    }
+
+    template<typename kernel>
+    int render_pgm (options const & opts, stream_kind)
+    {
+      std::fprintf (opts.log, "Kernel %s can't produce PGM output\n", kernel::name ());
+      return exit_usage;
+    }
+
+    // The output of limit in a levels render, the limit goes before the
+    //  extension of the file name
+    inline std::string level_output (options const & opts, std::uint32_t limit)
+    {
+      std::string output = opts.output ? opts.output : std::string (opts.program) + ".pbm";
+
+      auto name = output.find_last_of ("/\\");
+      auto ext  = output.rfind ('.');
+      if (ext == std::string::npos || (name != std::string::npos && ext < name))
+      {
+        ext = output.size ();
+      }
+
+      return output.substr (0, ext) + "." + std::to_string (limit) + output.substr (ext);
+    }
+
+    // One pass levels renders up to this size are rendered once per level
+    //  as well to check that each matches a render at its limit
+    constexpr std::size_t levels_check_bytes = 1U << 26;
+
+    template<typename kernel>
+    int render_levels (options const & opts)
+    {
+      auto & v = opts.v;
+
+      if (opts.fmt == format::pgm)
+      {
+        std::fprintf (opts.log, "Levels are rendered as PBM bitmaps only\n");
+        return exit_usage;
+      }
+
+      auto what = format_string ("Generating mandelbrot set %zux%zu(%u) at %zu levels", v.x, v.y, opts.levels.back (), opts.levels.size ());
+
+      return run_mode<kernel> (opts, what, has_levels<kernel>::value ? "" : ", a render per level", [&opts]
+      {
+        auto sets = timed (opts.log, [&opts] { return compute_levels<kernel> (opts.v, opts.levels, opts.sched); });
+
+        if (has_levels<kernel>::value && sets.front ()->sz*sets.size () <= levels_check_bytes)
+        {
+          for (auto l = 0U; l < sets.size (); ++l)
+          {
+            auto lv     = opts.v;
+            lv.max_iter = opts.levels[l];
+            auto single = std::get<0> (compute_set<kernel> (lv, opts.sched));
+
+            if (std::memcmp (single->bits (), sets[l]->bits (), single->sz) != 0)
+            {
+              std::fprintf (opts.log, "Level %u differs from a render at that limit\n", opts.levels[l]);
+              return exit_mismatch;
+            }
+          }
+
+          std::fprintf (opts.log, "  same sets as a render per level\n");
+        }
+
+        for (auto l = 0U; l < sets.size (); ++l)
+        {
+          auto output     = level_output (opts, opts.levels[l]);
+          auto lopts      = opts;
+          lopts.output    = opts.output && std::strcmp (opts.output, "-") == 0 ? opts.output : output.c_str ();
+
+          auto result = write_image (lopts, sets[l]->pbm (), sets[l]->pbm_size ());
+          if (result != 0)
+          {
+            return result;
+          }
+        }
+
+        return 0;
+      });
+    }
+
+    // Tiled renders up to this size are rendered row major as well to check
+    //  that only the layout changed
+    constexpr std::size_t tiles_check_bytes = 1U << 26;
+
+    template<typename kernel>
+    int render_tiled (options const & opts, block_kind)
+    {
+      auto & v = opts.v;
+
+      return run_mode<kernel> (opts, "Generating " + set_name (v) + " in tiles", [&opts, &v]
+      {
+        auto tiles = timed (opts.log, [&opts] { return compute_tiled<kernel> (opts.v, opts.sched); });
+
+        if (tiles->w*tiles->y <= tiles_check_bytes)
+        {
+          auto rows = std::get<0> (compute_set<kernel> (v, opts.sched));
+          auto copy = to_bitmap (*tiles, opts.sched);
+
+          if (std::memcmp (rows->bits (), copy->bits (), rows->sz) != 0)
+          {
+            std::fprintf (opts.log, "Tiles and rows produced different sets\n");
+            return exit_mismatch;
+          }
+
+          std::fprintf (opts.log, "  same set as the row major render\n");
+        }
+
+        auto written = time_it ([&opts, &tiles]
+        {
+          return write_output (opts, [&tiles] (int fd) { return write_tiled (fd, *tiles); });
+        });
+
+        std::fprintf (opts.log, "  streamed as PBM in %lld ms\n", static_cast<long long> (std::get<0> (written)));
+
+        return std::get<1> (written);
+      });
+    }
+
+    template<typename kernel>
+    int render_tiled (options const & opts, stream_kind)
+    {
+      std::fprintf (opts.log, "Kernel %s can't render tiles\n", kernel::name ());
+      return exit_usage;
+    }
+
+    template<typename kernel>
+    int render_tiled (options const & opts, count_kind)
+    {
+      std::fprintf (opts.log, "Kernel %s can't render tiles\n", kernel::name ());
+      return exit_usage;
+    }
+
+    template<typename kernel>
+    int render (options const & opts)
+    {
+      auto & v = opts.v;
+
+      if (opts.layout == bitmap_layout::tiles)
+      {
+        if (!opts.levels.empty () || opts.fmt == format::pgm)
+        {
+          std::fprintf (opts.log, "Tiles are rendered as a single PBM bitmap only\n");
+          return exit_usage;
+        }
+
+        return render_tiled<kernel> (opts, typename kernel::kind {});
+      }
+
+      if (!opts.levels.empty ())
+      {
+        return render_levels<kernel> (opts);
+      }
+
+      if (opts.fmt == format::pgm)
+      {
+        return render_pgm<kernel> (opts, typename kernel::kind {});
+      }
+
+      return run_mode<kernel> (opts, "Generating " + set_name (v), [&opts]
+      {
+        auto res    = timed (opts.log, [&opts] { return compute_set<kernel> (opts.v, opts.sched); });
+
+        auto& set   = std::get<0> (res);
+        auto& stats = std::get<1> (res);
+
+        if (stats.lane_steps > 0)
+        {
+          std::fprintf (opts.log, "  lane utilisation %.1f%%\n", 100.0*stats.utilisation ());
+        }
+
+        return write_image (opts, set->pbm (), set->pbm_size ());
+      });
+    }
+
+    // Runs f once to warm up, then repeatedly for about a second and
+    //  returns the mean time of one run in microseconds
+    template<typename F>
+    double mean_us (F const & f, std::size_t & runs)
+    {
+      using clock = std::chrono::high_resolution_clock;
+
+      f ();
+
+      runs        = 0;
+      auto before = clock::now ();
+      auto after  = before;
+      do
+      {
+        f ();
+        ++runs;
+        after = clock::now ();
+      } while (after - before < std::chrono::seconds (1));
+
+      auto us = std::chrono::duration_cast<std::chrono::microseconds> (after - before).count ();
+      return static_cast<double> (us) / runs;
+    }
+
+    // Renders repeatedly for about a second and returns the mean time of
+    //  one render in microseconds, the last set is kept in set. The warm up
+    //  also starts the worker pool or the OpenMP threads.
+    template<typename kernel>
+    double time_renders (view const & v, schedule sched, bitmap::uptr & set, std::size_t & renders)
+    {
+      return mean_us ([&v, sched, &set] { set = std::get<0> (compute_set<kernel> (v, sched)); }, renders);
+    }
+
+    template<typename kernel>
+    int compare (options const & opts)
+    {
+      auto & v = opts.v;
+
+      return run_mode<kernel> (opts.log, "Comparing schedules for " + set_name (v), nullptr, "", [&v, &opts]
+      {
+        // Serial first so its timing isn't disturbed by spinning workers
+        schedule const schedules[] = { schedule::serial, schedule::guided, schedule::cyclic };
+
+        bitmap::uptr first;
+        double       guided_us = 0;
+
+        for (auto sched : schedules)
+        {
+          bitmap::uptr set;
+          std::size_t  renders;
+
+          auto us = time_renders<kernel> (v, sched, set, renders);
+
+          std::fprintf (opts.log, "  %s %10.1f us per render (%zu renders)\n", schedule_name (sched), us, renders);
+
+          if (sched == schedule::guided)
+          {
+            guided_us = us;
+          }
+          else if (sched == schedule::cyclic)
+          {
+            std::fprintf (
+                opts.log
+              , "  cyclic/guided %.2f with %zu pinned threads\n"
+              , us / guided_us
+              , shared_pool ().size ()
+              );
+          }
+
+          if (!first)
+          {
+            first = std::move (set);
+          }
+          else if (std::memcmp (first->bits (), set->bits (), first->sz) != 0)
+          {
+            std::fprintf (opts.log, "Schedules produced different sets\n");
+            return exit_mismatch;
+          }
+        }
+
+        return 0;
+      });
+    }
+
+    template<typename kernel>
+    int batch (options const & opts)
+    {
+      auto from_stdin = !opts.jobs || std::strcmp (opts.jobs, "-") == 0;
+      auto file       = from_stdin ? stdin : std::fopen (opts.jobs, "r");
+      if (!file)
+      {
+        std::fprintf (opts.log, "Failed to open %s\n", opts.jobs);
+        return exit_io;
+      }
+
+      std::vector<job> jobs;
+      auto read = read_jobs (file, jobs, opts.log);
+
+      if (!from_stdin)
+      {
+        std::fclose (file);
+      }
+
+      if (!read)
+      {
+        return exit_usage;
+      }
+
+      // Messages go to stderr if any job writes to stdout
+      auto log = opts.log;
+      for (auto & j : jobs)
+      {
+        if (j.output == "-")
+        {
+          log = stderr;
+        }
+      }
+
+      return run_mode<kernel> (log, format_string ("Rendering %zu jobs", jobs.size ()), nullptr, "", [&opts, &jobs, log]
+      {
+        auto res = time_it ([&opts, &jobs, log]
+        {
+          pbm_writer writer (log);
+
+          for (auto & j : jobs)
+          {
+            auto sched = opts.auto_sched
+              ? (j.v.x*j.v.y <= tiny_pixels ? schedule::serial : schedule::cyclic)
+              : opts.sched
+              ;
+
+            auto set = create_bitmap (j.v.x, j.v.y);
+            compute_into<kernel> (j.v, sched, *set);
+            writer.push (std::move (set), j.output.c_str ());
+          }
+
+          return writer.finish ();
+        });
+
+        auto ms = std::get<0> (res);
+        auto ok = std::get<1> (res);
+
+        std::fprintf (
+            log
+          , "  it took %lld ms, %.1f jobs/sec\n"
+          , static_cast<long long> (ms)
+          , ms > 0 ? 1000.0*jobs.size () / ms : 0.0
+          );
+
+        return ok ? 0 : exit_io;
+      });
+    }
+
+    template<typename T>
+    long long time_us (T a)
+    {
+      auto before = std::chrono::high_resolution_clock::now ();
+      a ();
+      auto after  = std::chrono::high_resolution_clock::now ();
+      return static_cast<long long> (std::chrono::duration_cast<std::chrono::microseconds> (after - before).count ());
+    }
+
+    struct query_set
+    {
+      std::vector<double>         cx      ;
+      std::vector<double>         cy      ;
+      std::vector<std::uint32_t>  expected; // scalar escape counts
+      long long                   scalar_us;
+      lane_stats                  input   ; // lanes of groups in input order
+      lane_stats                  spatial ; // lanes of groups in spatial order
+    };
+
+    inline char const * query_order_name (query_order order) noexcept
+    {
+      return order == query_order::spatial ? "spatial" : "input";
+    }
+
+    // The lanes the groups of the points in order would step, from the scalar
+    //  escape counts. A group steps as long as its slowest point.
+    inline lane_stats query_lanes (query_set const & q, std::uint32_t max_iter, std::uint32_t const * order)
+    {
+      auto stats  = lane_stats {};
+      auto n      = q.expected.size ();
+
+      for (auto first = std::size_t (0); first < n; first += query_group)
+      {
+        auto last   = std::min (first + query_group, n);
+        auto slowest = 0U;
+        for (auto i = first; i < last; ++i)
+        {
+          auto steps = std::min (q.expected[order ? order[i] : i] + 1, max_iter);
+          slowest             = std::max (slowest, steps);
+          stats.useful_steps += steps;
+        }
+        stats.lane_steps += std::uint64_t (slowest)*query_group;
+      }
+
+      return stats;
+    }
+
+    // The input indices of the points in the order query_order::spatial
+    //  queries them
+    inline std::vector<std::uint32_t> spatial_order (query_set const & q)
+    {
+      auto n = q.cx.size ();
+      std::vector<std::uint32_t> order (n);
+
+      for (auto first = std::size_t (0); first < n; first += query_chunk)
+      {
+        sorted_chunk sorted (std::min (query_chunk, n - first), q.cx.data () + first, q.cy.data () + first);
+        for (auto i = 0U; i < sorted.n; ++i)
+        {
+          order[first + i] = static_cast<std::uint32_t> (first + sorted.order[i]);
+        }
+      }
+
+      return order;
+    }
+
+    inline void print_query (std::FILE * log, char const * what, query_order order, long long us, query_set const & q, std::size_t mismatches)
+    {
+      auto & lanes = order == query_order::spatial ? q.spatial : q.input;
+      std::fprintf (
+          log
+        , "  %-6s %-7s %8.1f ms, %7.1f Mpoints/s, %5.1fx scalar, %5.1f%% lanes, %zu mismatches\n"
+        , what
+        , query_order_name (order)
+        , us / 1000.0
+        , us > 0 ? static_cast<double> (q.cx.size ()) / us : 0.0
+        , us > 0 ? static_cast<double> (q.scalar_us) / us : 0.0
+        , 100.0*lanes.utilisation ()
+        , mismatches
+        );
+    }
+
+    template<typename kernel>
+    void query_counts (options const & opts, query_set const & q, std::true_type)
+    {
+      auto n = q.cx.size ();
+      std::vector<std::uint32_t> counts (n);
+
+      for (auto order : { query_order::input, query_order::spatial })
+      {
+        auto us = time_us ([&] { mandel::query_counts<kernel> (n, q.cx.data (), q.cy.data (), opts.v.max_iter, counts.data (), opts.sched, order); });
+
+        auto mismatches = std::size_t (0);
+        for (auto i = 0U; i < n; ++i)
+        {
+          mismatches += counts[i] != q.expected[i];
+        }
+
+        print_query (opts.log, "counts", order, us, q, mismatches);
+      }
+    }
+
+    template<typename kernel>
+    void query_counts (options const &, query_set const &, std::false_type)
+    {
+    }
+
+    template<typename kernel>
+    void query_inside (options const & opts, query_set const & q, std::true_type)
+    {
+      auto n = q.cx.size ();
+      std::vector<std::uint8_t> inside ((n + 7) / 8);
+
+      for (auto order : { query_order::input, query_order::spatial })
+      {
+        auto us = time_us ([&] { mandel::query_inside<kernel> (n, q.cx.data (), q.cy.data (), opts.v.max_iter, inside.data (), opts.sched, order); });
+
+        auto mismatches = std::size_t (0);
+        for (auto i = 0U; i < n; ++i)
+        {
+          auto bit = (inside[i / 8] >> (i % 8)) & 1U;
+          mismatches += bit != (q.expected[i] == opts.v.max_iter ? 1U : 0U);
+        }
+
+        print_query (opts.log, "inside", order, us, q, mismatches);
+      }
+    }
+
+    template<typename kernel>
+    void query_inside (options const &, query_set const &, std::false_type)
+    {
+    }
+
+    // Times the bulk queries of the kernel on random points of the viewport
+    //  against the scalar loop, in input and in spatial order. The spatial
+    //  times include sorting the points and putting the results back in input
+    //  order. Points near the boundary may mismatch at high
+    //  max_iter, the vector kernels round differently (FMA, operation order).
+    template<typename kernel>
+    int query (options const & opts)
+    {
+      auto & v = opts.v;
+
+      if (!has_query_counts<kernel>::value && !has_query_inside<kernel>::value)
+      {
+        std::fprintf (opts.log, "Kernel %s has no bulk queries\n", kernel::name ());
+        return exit_usage;
+      }
+
+      return run_mode<kernel> (opts, format_string ("Querying %zu random points(%u)", opts.points, v.max_iter), [&v, &opts]
+      {
+        auto q = query_set {};
+
+        std::mt19937_64 random (19740531);
+        std::uniform_real_distribution<double> random_x (v.min_x, v.max_x);
+        std::uniform_real_distribution<double> random_y (v.min_y, v.max_y);
+
+        q.cx.resize (opts.points);
+        q.cy.resize (opts.points);
+        for (auto i = 0U; i < opts.points; ++i)
+        {
+          q.cx[i] = random_x (random);
+          q.cy[i] = random_y (random);
+        }
+
+        q.expected.resize (opts.points);
+        q.scalar_us = time_us ([&q, &v]
+        {
+          for (auto i = 0U; i < q.cx.size (); ++i)
+          {
+            q.expected[i] = scalar_count (q.cx[i], q.cy[i], v.max_iter);
+          }
+        });
+
+        q.input   = query_lanes (q, v.max_iter, nullptr);
+        q.spatial = query_lanes (q, v.max_iter, spatial_order (q).data ());
+
+        std::fprintf (opts.log, "  scalar         %8.1f ms\n", q.scalar_us / 1000.0);
+
+        query_counts<kernel> (opts, q, has_query_counts<kernel> {});
+        query_inside<kernel> (opts, q, has_query_inside<kernel> {});
+
+        return 0;
+      });
+    }
+
+    // Pans a render by growing steps, each incrementally and in full, and
+    //  compares the times and the pixels. The view is snapped so the two
+    //  must be equal.
+    template<typename kernel>
+    int pan (options const & opts)
+    {
+      auto v = snap_view (opts.v);
+
+      return run_mode<kernel> (opts, "Panning " + set_name (v), [&v, &opts]
+      {
+        auto prev = std::get<0> (compute_set<kernel> (v, opts.sched));
+        auto full = create_bitmap (v.x, v.y);
+        auto inc  = create_bitmap (v.x, v.y);
+
+        // Thousandths of the width, half as many rows, both ways
+        std::ptrdiff_t const steps[] = { 1, 3, -5, 13, -80, 250 };
+
+        auto differ = false;
+
+        for (auto step : steps)
+        {
+          auto d  = step*static_cast<std::ptrdiff_t> (v.x) / 1000;
+          auto pv = pan_view (v, d, d/2);
+
+          auto full_us  = time_us ([&] { compute_into<kernel> (pv, opts.sched, *full); });
+          auto stats    = pan_stats {};
+          auto inc_us   = time_us ([&] { stats = compute_pan<kernel> (v, *prev, pv, opts.sched, *inc); });
+
+          auto diff = std::size_t (0);
+          for (auto i = 0U; i < full->sz; ++i)
+          {
+            for (auto b = full->bits ()[i] ^ inc->bits ()[i]; b != 0; b &= b - 1)
+            {
+              ++diff;
+            }
+          }
+
+          std::fprintf (
+              opts.log
+            , "  pan %5td,%5td  full %8lld us  incremental %8lld us  %5.1f%% computed  %5.2fx  %zu pixels differ%s\n"
+            , d
+            , d/2
+            , full_us
+            , inc_us
+            , 100.0*stats.computed_bytes / full->sz
+            , inc_us > 0 ? static_cast<double> (full_us) / inc_us : 0.0
+            , diff
+            , stats.reused ? "" : " (full render)"
+            );
+
+          differ = differ || diff > 0;
+        }
+
+        if (differ)
+        {
+          std::fprintf (opts.log, "Incremental and full renders produced different sets\n");
+          return exit_mismatch;
+        }
+
+        return 0;
+      });
+    }
+
+    // Renders a mostly exterior view, where storing the bitmap costs more
+    //  than computing it, and compares the bandwidth with filling the same
+    //  bitmap on the same schedule
+    template<typename kernel>
+    int bandwidth (options const & opts)
+    {
+      auto & v = opts.v;
+
+      return run_mode<kernel> (opts, "Bandwidth of " + set_name_over (v), [&v, &opts]
+      {
+        auto width = (v.x + 7) / 8;
+
+        auto outside = std::size_t (0);
+        for (auto y = 0U; y < v.y; ++y)
+        {
+          std::size_t b0;
+          std::size_t b1;
+          disk_bytes (v, 1, y, b0, b1);
+          outside += width - (b1 - b0);
+        }
+
+        // Both time the same bitmap, faulted in by the warm up, so the
+        //  timings are of stores and not of page faults
+        auto set  = create_bitmap (v.x, v.y);
+        auto bits = set->bits ();
+
+        std::size_t renders;
+        auto render_us  = mean_us ([&v, &opts, &set] { compute_into<kernel> (v, opts.sched, *set); }, renders);
+
+        // STREAM-like fill, row bands spread as the schedule spreads row groups
+        std::size_t fills;
+        auto fill_us    = mean_us ([&v, &opts, bits, width]
+        {
+          for_each_block (v.y, cyclic_band_rows, opts.sched, [&v, bits, width] (std::size_t band)
+          {
+            auto y0 = band*cyclic_band_rows;
+            auto y1 = std::min<std::size_t> (y0 + cyclic_band_rows, v.y);
+            std::memset (bits + y0*width, 0, (y1 - y0)*width);
+          });
+        }, fills);
+
+        auto render_gbs = set->sz / render_us / 1000.0;
+        auto fill_gbs   = set->sz / fill_us / 1000.0;
+
+        std::fprintf (opts.log, "  %.1f%% of the bytes are outside the disk of radius 2\n", 100.0*outside / set->sz);
+        std::fprintf (opts.log, "  render %10.1f us %7.2f GB/s (%zu renders)\n", render_us, render_gbs, renders);
+        std::fprintf (opts.log, "  fill   %10.1f us %7.2f GB/s (%zu fills)\n", fill_us, fill_gbs, fills);
+        std::fprintf (opts.log, "  render/fill %.1f%% of the fill bandwidth\n", 100.0*render_gbs / fill_gbs);
+
+        return 0;
+      });
+    }
+
+    // Deepens a render_session step by step and compares the times and
+    //  the pixels with fresh renders at the same max_iter, which must be
+    //  equal
+    template<typename kernel>
+    int deepen (options const & opts, std::true_type)
+    {
+      auto & v = opts.v;
+
+      return run_mode<kernel> (opts, format_string ("Deepening mandelbrot set %zux%zu", v.x, v.y), [&v, &opts]
+      {
+        std::uint32_t const iters[] = { v.max_iter, 4*v.max_iter, 20*v.max_iter };
+
+        std::unique_ptr<render_session<kernel>> session;
+
+        auto differ = false;
+
+        for (auto iter : iters)
+        {
+          auto fv     = v;
+          fv.max_iter = iter;
+
+          bitmap::uptr fresh;
+          auto fresh_us   = time_us ([&] { fresh = std::get<0> (compute_set<kernel> (fv, opts.sched)); });
+          auto session_us = time_us ([&]
+          {
+            if (session)
+            {
+              session->deepen (iter);
+            }
+            else
+            {
+              session = std::make_unique<render_session<kernel>> (fv, opts.sched);
+            }
+          });
+
+          auto & set  = session->set ();
+          auto diff   = std::size_t (0);
+          for (auto i = 0U; i < set.sz; ++i)
+          {
+            for (auto b = fresh->bits ()[i] ^ set.bits ()[i]; b != 0; b &= b - 1)
+            {
+              ++diff;
+            }
+          }
+
+          std::fprintf (
+              opts.log
+            , "  max_iter %6u  fresh %9lld us  session %9lld us  %5.2fx  %zu unresolved  %zu pixels differ\n"
+            , iter
+            , fresh_us
+            , session_us
+            , session_us > 0 ? static_cast<double> (fresh_us) / session_us : 0.0
+            , session->unresolved ()
+            , diff
+            );
+
+          differ = differ || diff > 0;
+        }
+
+        if (differ)
+        {
+          std::fprintf (opts.log, "Deepened and fresh renders produced different sets\n");
+          return exit_mismatch;
+        }
+
+        return 0;
+      });
+    }
+
+    // Without advance a session would continue the orbits in another
+    //  kernel's arithmetic
+    template<typename kernel>
+    int deepen (options const & opts, std::false_type)
+    {
+      std::fprintf (opts.log, "Kernel %s can't continue orbits, use a kernel with advance\n", kernel::name ());
+      return exit_usage;
+    }
+
+    // Bitmaps up to this size are rendered as well to check the count
+    constexpr std::size_t count_check_bytes = 1U << 28;
+
+    // Counts the pixels of the view inside the set and estimates its area
+    template<typename kernel>
+    int count (options const & opts, block_kind)
+    {
+      auto & v = opts.v;
+
+      return run_mode<kernel> (opts, "Counting " + set_name_over (v), [&v, &opts]
+      {
+        area_count c;
+        auto count_us = time_us ([&] { c = count_set<kernel> (v, opts.sched); });
+
+        auto pixels = static_cast<std::uint64_t> (v.x)*v.y;
+        std::fprintf (
+            opts.log
+          , "  %llu of %llu pixels inside, %llu edges, %lld us (%.2f ns/pixel)\n"
+          , static_cast<unsigned long long> (c.inside)
+          , static_cast<unsigned long long> (pixels)
+          , static_cast<unsigned long long> (c.edges)
+          , count_us
+          , 1000.0*count_us / pixels
+          );
+        std::fprintf (opts.log, "  area %.9f, estimated error %.9f\n", c.area (v), c.error_estimate (v));
+
+        if ((v.x + 7) / 8*v.y <= count_check_bytes)
+        {
+          bitmap::uptr set;
+          auto render_us  = time_us ([&] { set = std::get<0> (compute_set<kernel> (v, opts.sched)); });
+          auto inside     = std::uint64_t (0);
+          for (auto i = 0U; i < set->sz; ++i)
+          {
+            inside += popcount (set->bits ()[i]);
+          }
+
+          std::fprintf (
+              opts.log
+            , "  render and popcount %llu pixels inside, %lld us, %s\n"
+            , static_cast<unsigned long long> (inside)
+            , render_us
+            , inside == c.inside ? "same count" : "COUNTS DIFFER"
+            );
+
+          if (inside != c.inside)
+          {
+            return exit_mismatch;
+          }
+        }
+
+        return 0;
+      });
+    }
+
+    // The precise pass of a hybrid kernel is its compute_word
+    template<typename kernel>
+    int count (options const & opts, hybrid_kind)
+    {
+      return count<kernel> (opts, block_kind {});
+    }
+
+    template<typename kernel, typename kind>
+    int count (options const & opts, kind)
+    {
+      std::fprintf (opts.log, "Kernel %s renders no bitmap words to count, use a block kernel\n", kernel::name ());
+      return exit_usage;
+    }
+
+    // Renders the density of the escaping orbits into a PGM
+    template<typename kernel>
+    int buddhabrot (options const & opts)
+    {
+      auto & v = opts.v;
+
+      auto what = format_string (
+          "Generating buddhabrot %zux%zu(%u) over [%g,%g]x[%g,%g] from %llu %s samples"
+        , v.x
+        , v.y
+        , v.max_iter
+        , v.min_x
+        , v.max_x
+        , v.min_y
+        , v.max_y
+        , static_cast<unsigned long long> (opts.samples)
+        , sampling_name (opts.how)
+        );
+
+      return run_mode<kernel> (opts, what, has_query_counts<kernel>::value && has_trace<kernel>::value ? "" : ", scalar orbits", [&opts]
+      {
+        auto d    = timed (opts.log, [&opts] { return compute_density<kernel> (opts.v, opts.samples, opts.how, opts.sched); });
+
+        auto hits = std::uint64_t (0);
+        for (auto h : d.hits)
+        {
+          hits += h;
+        }
+
+        std::fprintf (
+            opts.log
+          , "  %llu orbits escaped (%.1f%%), %llu hits, %llu of %zu cells sampled\n"
+          , static_cast<unsigned long long> (d.orbits)
+          , d.samples > 0 ? 100.0*d.orbits / d.samples : 0.0
+          , static_cast<unsigned long long> (hits)
+          , static_cast<unsigned long long> (d.cells)
+          , density_cells*density_cells
+          );
+
+        auto grey     = shade_density (d);
+        auto gopts    = opts;
+        gopts.fmt     = format::pgm;
+
+        return write_image (gopts, grey->pgm (), grey->pgm_size ());
+      });
+    }
+
+    inline bool has_kernel (char const *, kernel_list<>) noexcept
+    {
+      return false;
+    }
+
+    template<typename kernel, typename... rest>
+    bool has_kernel (char const * name, kernel_list<kernel, rest...>) noexcept
+    {
+      return std::strcmp (name, kernel::name ()) == 0 || has_kernel (name, kernel_list<rest...> {});
+    }
+
+    inline int select_kernel (options const & opts, char const *, kernel_list<>)
+    {
+      std::fprintf (opts.log, "No kernel is supported by this CPU\n");
+      return exit_usage;
+    }
+
+    // Picks the kernel matching name, or the first supported one when no
+    //  name is given
+    template<typename kernel, typename... rest>
+    int select_kernel (options const & opts, char const * name, kernel_list<kernel, rest...>)
+    {
+      auto pick = name
+        ? std::strcmp (name, kernel::name ()) == 0
+        : kernel::supported ()
+        ;
+
+      if (!pick)
+      {
+        return select_kernel (opts, name, kernel_list<rest...> {});
+      }
+
+      if (!kernel::supported ())
+      {
+        std::fprintf (opts.log, "Kernel %s is not supported by this CPU\n", name);
+        return exit_usage;
+      }
+
+      switch (opts.what)
+      {
+      case mode::compare:
+        return compare<kernel> (opts);
+      case mode::batch:
+        return batch<kernel> (opts);
+      case mode::query:
+        return query<kernel> (opts);
+      case mode::pan:
+        return pan<kernel> (opts);
+      case mode::bandwidth:
+        return bandwidth<kernel> (opts);
+      case mode::deepen:
+        return deepen<kernel> (opts, has_advance<kernel> {});
+      case mode::count:
+        return count<kernel> (opts, typename kernel::kind {});
+      case mode::buddhabrot:
+        return buddhabrot<kernel> (opts);
+      case mode::render:
+        break;
+      }
+
+      return render<kernel> (opts);
+    }
+  }
+
+  // Usage: <program> [dim] [kernel|auto] [max_iter] [guided|cyclic|serial|compare|auto] [output|-] [options]
+  //        <program> batch [jobs|-] [kernel|auto] [guided|cyclic|serial|auto] [options]
+  //        <program> query [points] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]
+  //        <program> pan [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]
+  //        <program> bandwidth [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]
+  //        <program> deepen [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]
+  //        <program> count [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [options]
+  //        <program> buddhabrot [dim] [kernel|auto] [guided|cyclic|serial|auto] [max_iter] [output|-] [options]
+  //  Every setting can also be given as a named option or an environment
+  //  variable, see details::print_usage. Named options win over arguments in
+  //  their places, which win over the environment.
+  //  auto picks the serial schedule for tiny renders, otherwise guided (cyclic
+  //  in batch mode so the jobs share the worker pool)
+  //  - writes the image to stdout, messages then go to stderr
+  //  The pgm format, the default for an output ending in .pgm, is a
+  //  greyscale image, an anti-aliased thumbnail from a block kernel or shaded
+  //  escape counts from a count kernel
+  //  Batch mode renders the jobs of a job file or stdin, see read_jobs
+  //  Query mode times the bulk queries on random points, serial unless a
+  //  schedule is given so the speedup over the scalar loop is per core
+  //  Pan mode times incremental pans of a render against full renders and
+  //  fails if any pixel differs, the view snapped with snap_view
+  //  Bandwidth mode times renders of a view that is nearly all outside the
+  //  set against filling the bitmap, by default a 16000x16000 render of
+  //  [-32,32]x[-32,32]
+  //  Deepen mode renders at max_iter, 4 and 20 times max_iter with a
+  //  render_session and times each step against a fresh render, and fails
+  //  if any pixel differs. Only kernels with advance can deepen.
+  //  Count mode counts the pixels inside with a block kernel and no bitmap,
+  //  sizes up to 2^24 a side, and checks the count against a render when the
+  //  bitmap is small enough
+  //  Buddhabrot mode writes the density of the escaping orbits as a PGM, by
+  //  default 10M points sampled uniformly, max_iter 1000 and a 1000x1000
+  //  view of [-2,1]x[-1.5,1.5], see compute_density
+  //  --levels renders one bitmap per limit, in one pass with kernels that
+  //  support it. Each is written to the output with the limit put before its
+  //  extension, mandelbrot.50.pbm for mandelbrot.pbm, or one after the other
+  //  to stdout. One pass renders up to 64 MB are rendered per level as well
+  //  and must be equal.
+  //  --layout tiles renders a block kernel into a tiled_bitmap, each worker
+  //  writing whole tiles, and streams it as PBM a band of tiles at a time.
+  //  Bitmaps up to 64 MB are rendered row major as well and must be equal.
+  //  Invalid settings print why and return exit_usage, failed reads and
+  //  writes return exit_io and failed self checks exit_mismatch
+  template<typename... kernels>
+  int run (char const * program, int argc, char const * argv[])
+  {
+    for (auto i = 1; i < argc; ++i)
+    {
+      if (std::strcmp (argv[i], "--help") == 0 || std::strcmp (argv[i], "-h") == 0)
+      {
+        details::print_usage (stdout, program);
+        return 0;
+      }
+    }
+
+    auto s        = details::settings {};
+    s.what        = mode::render;
+    s.box[0]      = min_x;
+    s.box[1]      = min_y;
+    s.box[2]      = max_x;
+    s.box[3]      = max_y;
+    s.x           = 200;
+    s.y           = 200;
+    s.iter        = max_iter;
+    s.kernel      = nullptr;
+    s.threads     = 0;
+    s.sched       = schedule::guided;
+    s.auto_sched  = true;
+    s.output      = nullptr;
+    s.auto_fmt    = true;
+    s.fmt         = format::pbm;
+    s.layout      = bitmap_layout::rows;
+    s.points      = 1000000U;
+    s.jobs        = nullptr;
+    s.samples     = buddhabrot_samples;
+    s.how         = sampling::uniform;
+    s.formula     = default_formula;
+    s.pool_mb     = pool_cap_mb;
+
+    if (argc > 1)
+    {
+      if (std::strcmp (argv[1], "batch") == 0)
+      {
+        s.what = mode::batch;
+      }
+      else if (std::strcmp (argv[1], "query") == 0)
+      {
+        s.what = mode::query;
+      }
+      else if (std::strcmp (argv[1], "pan") == 0)
+      {
+        s.what = mode::pan;
+      }
+      else if (std::strcmp (argv[1], "deepen") == 0)
+      {
+        s.what = mode::deepen;
+      }
+      else if (std::strcmp (argv[1], "count") == 0)
+      {
+        s.what = mode::count;
+      }
+      else if (std::strcmp (argv[1], "buddhabrot") == 0)
+      {
+        s.what    = mode::buddhabrot;
+        s.box[0]  = -2.0;
+        s.box[1]  = -1.5;
+        s.box[2]  = 1.0;
+        s.box[3]  = 1.5;
+        s.x       = 1000;
+        s.y       = 1000;
+        s.iter    = buddhabrot_iter;
+      }
+      else if (std::strcmp (argv[1], "bandwidth") == 0)
+      {
+        s.what    = mode::bandwidth;
+        s.box[0]  = -bandwidth_extent;
+        s.box[1]  = -bandwidth_extent;
+        s.box[2]  = bandwidth_extent;
+        s.box[3]  = bandwidth_extent;
+        s.x       = bandwidth_dim;
+        s.y       = bandwidth_dim;
+      }
+    }
+
+    if (!details::parse_settings (program, argc, argv, s))
+    {
+      return exit_usage;
+    }
+
+    if (s.kernel && !details::has_kernel (s.kernel, kernel_list<kernels...> {}))
+    {
+      std::fprintf (stderr, "Unknown kernel %s, available kernels:", s.kernel);
+      details::print_kernels (stderr, kernel_list<kernels...> {});
+      return exit_usage;
+    }
+
+    set_threads (s.threads);
+    shared_formula () = s.formula;
+    shared_bitmap_pool ().set_cap (s.pool_mb << 20);
+
+    auto opts       = options {};
+    opts.program    = program;
+    opts.what       = s.what;
+    opts.v          = make_view (s.box[0], s.box[1], s.box[2], s.box[3], s.x, s.y, s.iter);
+    opts.sched      = s.sched;
+    opts.auto_sched = s.auto_sched;
+    opts.output     = s.output;
+    opts.fmt        = s.fmt;
+    opts.layout     = s.layout;
+    opts.jobs       = s.jobs;
+    opts.points     = s.points;
+    opts.levels     = s.levels;
+    opts.samples    = s.samples;
+    opts.how        = s.how;
+    opts.log        = s.output && std::strcmp (s.output, "-") == 0 ? stderr : stdout;
+
+    if (s.auto_sched)
+    {
+      opts.sched = s.what == mode::query || opts.v.x*opts.v.y <= tiny_pixels ? schedule::serial : schedule::guided;
+    }
+
+    return details::select_kernel (opts, s.kernel, kernel_list<kernels...> {});
+  }
+}
@@ -0,0 +1,291 @@
+// ----------------------------------------------------------------------------------------------
+// Copyright 2017 Mårten Rånge
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------------------------
+
+// A fixed set of std::threads, each pinned to one of the CPUs the process may
+//  run on. The calling thread takes part as worker 0 and is pinned for the
+//  lifetime of the pool. Used by the cyclic schedule in place of OpenMP.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <emmintrin.h>
+
+#ifdef _MSVC_LANG
+# ifndef NOMINMAX
+#   define NOMINMAX
+# endif
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+namespace mandel
+{
+  namespace details
+  {
+#ifdef _MSVC_LANG
+    using cpu_mask = DWORD_PTR;
+
+    inline cpu_mask current_affinity () noexcept
+    {
+      DWORD_PTR process;
+      DWORD_PTR system;
+      return GetProcessAffinityMask (GetCurrentProcess (), &process, &system)
+        ? process
+        : 1
+        ;
+    }
+
+    inline std::vector<std::size_t> allowed_cpus (cpu_mask const & mask)
+    {
+      std::vector<std::size_t> cpus;
+      for (auto cpu = 0U; cpu < sizeof (cpu_mask)*8; ++cpu)
+      {
+        if (mask & (cpu_mask (1) << cpu))
+        {
+          cpus.push_back (cpu);
+        }
+      }
+      return cpus;
+    }
+
+    inline void pin_thread (HANDLE thread, std::size_t cpu) noexcept
+    {
+      SetThreadAffinityMask (thread, cpu_mask (1) << cpu);
+    }
+
+    inline void pin_thread (std::thread & thread, std::size_t cpu) noexcept
+    {
+      pin_thread (thread.native_handle (), cpu);
+    }
+
+    inline void pin_current (std::size_t cpu) noexcept
+    {
+      pin_thread (GetCurrentThread (), cpu);
+    }
+
+    inline void restore_current (cpu_mask const & mask) noexcept
+    {
+      SetThreadAffinityMask (GetCurrentThread (), mask);
+    }
+#else
+    using cpu_mask = cpu_set_t;
+
+    inline cpu_mask current_affinity () noexcept
+    {
+      cpu_mask mask;
+      CPU_ZERO (&mask);
+      if (pthread_getaffinity_np (pthread_self (), sizeof mask, &mask) != 0)
+      {
+        CPU_SET (0, &mask);
+      }
+      return mask;
+    }
+
+    inline std::vector<std::size_t> allowed_cpus (cpu_mask const & mask)
+    {
+      std::vector<std::size_t> cpus;
+      for (auto cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      {
+        if (CPU_ISSET (cpu, &mask))
+        {
+          cpus.push_back (static_cast<std::size_t> (cpu));
+        }
+      }
+      return cpus;
+    }
+
+    inline void pin_thread (pthread_t thread, std::size_t cpu) noexcept
+    {
+      cpu_mask mask;
+      CPU_ZERO (&mask);
+      CPU_SET (cpu, &mask);
+      pthread_setaffinity_np (thread, sizeof mask, &mask);
+    }
+
+    inline void pin_thread (std::thread & thread, std::size_t cpu) noexcept
+    {
+      pin_thread (thread.native_handle (), cpu);
+    }
+
+    inline void pin_current (std::size_t cpu) noexcept
+    {
+      pin_thread (pthread_self (), cpu);
+    }
+
+    inline void restore_current (cpu_mask const & mask) noexcept
+    {
+      pthread_setaffinity_np (pthread_self (), sizeof mask, &mask);
+    }
+#endif
+  }
+
+  struct worker_pool
+  {
+    // Starts a worker per allowed CPU, at most limit unless it is 0
+    explicit worker_pool (std::size_t limit = 0)
+      : affinity    (details::current_affinity ())
+      , cpus        (details::allowed_cpus (affinity))
+      , job         (nullptr)
+      , context     (nullptr)
+      , generation  (0)
+      , pending     (0)
+      , stop        (false)
+    {
+      if (cpus.empty ())
+      {
+        cpus.push_back (0);
+      }
+
+      if (limit > 0 && cpus.size () > limit)
+      {
+        cpus.resize (limit);
+      }
+
+      details::pin_current (cpus[0]);
+
+      threads.reserve (cpus.size () - 1);
+      for (auto t = 1U; t < cpus.size (); ++t)
+      {
+        threads.emplace_back ([this, t] { work (t); });
+        details::pin_thread (threads.back (), cpus[t]);
+      }
+    }
+
+    ~worker_pool () noexcept
+    {
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        stop = true;
+        generation.fetch_add (1, std::memory_order_release);
+      }
+      wake.notify_all ();
+
+      for (auto & thread : threads)
+      {
+        thread.join ();
+      }
+
+      details::restore_current (affinity);
+    }
+
+    worker_pool (worker_pool const &)             = delete;
+    worker_pool& operator= (worker_pool const &)  = delete;
+
+    std::size_t size () const noexcept
+    {
+      return cpus.size ();
+    }
+
+    // Runs f (t) on every worker t in [0, size ()) and returns when all are done
+    template<typename F>
+    void run (F && f)
+    {
+      using func = typename std::remove_reference<F>::type;
+
+      context = &f;
+      job     = [] (void * c, std::size_t t) { (*static_cast<func *> (c)) (t); };
+      pending.store (threads.size (), std::memory_order_relaxed);
+
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        generation.fetch_add (1, std::memory_order_release);
+      }
+      wake.notify_all ();
+
+      f (0);
+
+      while (pending.load (std::memory_order_acquire) > 0)
+      {
+        _mm_pause ();
+      }
+    }
+
+  private:
+    // Workers spin a while on the generation before sleeping so back to back
+    //  renders don't pay for a wake up
+    static constexpr auto spin_count = 1U << 16;
+
+    void work (std::size_t t)
+    {
+      std::uint64_t seen = 0;
+
+      for (;;)
+      {
+        auto spins = 0U;
+        while (generation.load (std::memory_order_acquire) == seen && spins < spin_count)
+        {
+          _mm_pause ();
+          ++spins;
+        }
+
+        if (generation.load (std::memory_order_acquire) == seen)
+        {
+          std::unique_lock<std::mutex> lock (mutex);
+          wake.wait (lock, [this, seen] { return generation.load (std::memory_order_relaxed) != seen; });
+        }
+
+        seen = generation.load (std::memory_order_acquire);
+
+        if (stop)
+        {
+          return;
+        }
+
+        job (context, t);
+
+        pending.fetch_sub (1, std::memory_order_acq_rel);
+      }
+    }
+
+    details::cpu_mask           affinity    ;
+    std::vector<std::size_t>    cpus        ;
+    std::vector<std::thread>    threads     ;
+
+    void (*                     job) (void *, std::size_t);
+    void *                      context     ;
+
+    std::atomic<std::uint64_t>  generation  ;
+    std::atomic<std::size_t>    pending     ;
+    std::mutex                  mutex       ;
+    std::condition_variable     wake        ;
+    bool                        stop        ;
+  };
+
+  // Workers of the shared pool, 0 for one per allowed CPU. Only read when
+  //  the pool starts.
+  inline std::size_t & shared_pool_limit () noexcept
+  {
+    static std::size_t limit = 0;
+    return limit;
+  }
+
+  // The pool is only started when the cyclic schedule is used
+  inline worker_pool & shared_pool ()
+  {
+    static worker_pool pool (shared_pool_limit ());
+    return pool;
+  }
+}
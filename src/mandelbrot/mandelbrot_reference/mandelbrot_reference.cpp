@@ -18,92 +18,13 @@
 
 #include "stdafx.h"
 
-#include <cassert>
-#include <cstddef>
-#include <cstdio>
-#include <chrono>
-#include <memory>
-#include <tuple>
+#include "../mandelbrot_engine/mandelbrot_engine.hpp"
 
 namespace
 {
-  constexpr auto    min_x    = -1.5 ;
-  constexpr auto    min_y    = -1.0 ;
-  constexpr auto    max_x    =  0.5 ;
-  constexpr auto    max_y    =  1.0 ;
-  constexpr auto    max_iter =  50U ;
-
-  template<typename T>
-  auto time_it (T a)
-  {
-    auto before = std::chrono::high_resolution_clock::now ();
-    auto result = a ();
-    auto after  = std::chrono::high_resolution_clock::now ();
-    auto diff   = std::chrono::duration_cast<std::chrono::milliseconds> (after - before).count ();
-    return std::make_tuple (diff, std::move (result));
-  }
-
-
-  struct bitmap
-  {
-    using uptr = std::unique_ptr<bitmap>;
-
-    std::size_t const x ;
-    std::size_t const y ;
-    std::size_t const w ;
-    std::size_t const sz;
-
-    bitmap (std::size_t x, std::size_t y) noexcept
-      : x   (x)
-      , y   (y)
-      , w   ((x + 7) / 8)
-      , sz  (w*y)
-    {
-      b = static_cast<std::uint8_t*> (malloc(sz));
-    }
-
-    ~bitmap () noexcept
-    {
-      free (b);
-      b = nullptr;
-    }
-
-    bitmap (bitmap && bm) noexcept
-      : x   (bm.x)
-      , y   (bm.y)
-      , w   (bm.w)
-      , b   (bm.b)
-      , sz  (bm.sz)
-    {
-      bm.b = nullptr;
-    }
-
-    bitmap (bitmap const &)             = delete;
-    bitmap& operator= (bitmap const &)  = delete;
-    bitmap& operator= (bitmap &&)       = delete;
-
-    std::uint8_t * bits () noexcept
-    {
-      assert (b);
-      return b;
-    }
-
-    std::uint8_t const * bits () const noexcept
-    {
-      assert (b);
-      return b;
-    }
-
-  private:
-    std::uint8_t * b;
-  };
-
-  bitmap::uptr create_bitmap (std::size_t x, std::size_t y)
-  {
-    return std::make_unique<bitmap> (x, y);
-  }
+  using mandel::view;
 
-  auto mandelbrot (double cx, double cy)
+  auto mandelbrot (double cx, double cy, std::uint32_t max_iter)
   {
     auto x    = cx      ;
     auto y    = cy      ;
@@ -123,71 +44,53 @@ namespace
     return iter;
   }
 
-  bitmap::uptr compute_set (std::size_t const dim)
+  struct reference_kernel
   {
-    auto set    = create_bitmap (dim, dim);
-    auto width  = set->w;
-    auto pset   = set->bits ();
+    using kind = mandel::block_kind;
 
-    auto scalex = (max_x - min_x) / dim;
-    auto scaley = (max_y - min_y) / dim;
+    static constexpr std::size_t rows = 1;
 
-    for (auto y = 0U; y < dim; ++y)
+    static char const * name () noexcept
     {
-      auto yoffset = y*width;
-      for (auto w = 0U; w < width; ++w)
+      return "reference";
+    }
+
+    static bool supported () noexcept
+    {
+      return true;
+    }
+
+    explicit reference_kernel (view const & v) noexcept
+      : v (v)
+    {
+    }
+
+    void compute_word (std::size_t y, std::size_t ww, std::size_t bytes, std::uint64_t * words) const noexcept
+    {
+      for (auto w = ww; w < ww + bytes; ++w)
       {
         auto bits = 0U;
         for (auto bit = 0U; bit < 8U; ++bit)
         {
           auto x = w*8 + bit;
 
-          auto i = mandelbrot (scalex*x + min_x, scaley*y + min_y);
+          auto i = mandelbrot (v.scale_x*x + v.min_x, v.scale_y*y + v.min_y, v.max_iter);
 
           if (i == 0)
           {
             bits |= 1 << (7U - bit);
           }
         }
-        pset[yoffset + w] = bits;
+        words[0] |= static_cast<std::uint64_t> (bits) << 8*(w - ww);
       }
     }
 
-    return set;
-  }
-
+  private:
+    view v;
+  };
 }
 
 int main (int argc, char const * argv[])
 {
-  auto dim  = [argc, argv] ()
-  {
-    auto dim = argc > 1 ? atoi (argv[1]) : 0;
-    return dim > 0 ? dim : 200;
-  } ();
-
-  if (dim % 8 != 0)
-  {
-    std::printf ("Dimension must be modulo 8\n");
-    return 999;
-  }
-
-  std::printf ("Generating mandelbrot set %dx%d(%d)\n", dim, dim, max_iter);
-
-  auto res  = time_it ([dim] { return compute_set(dim); });
-
-  auto ms   = std::get<0> (res);
-  auto& set = std::get<1> (res);
-
-  std::printf ("  it took %lld ms\n", ms);
-
-  auto file = std::fopen ("mandelbrot_reference.pbm", "wb");
-
-  std::fprintf (file, "P4\n%d %d\n", dim, dim);
-  std::fwrite (set->bits (), 1, set-> sz, file);
-
-  std::fclose (file);
-
-  return 0;
+  return mandel::run<reference_kernel> ("mandelbrot_reference", argc, argv);
 }
-